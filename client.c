@@ -47,13 +47,15 @@ int main() {
 				/* obtain client number */
 
 	msg.mtype = REGISTER;
+	msg.client = getpid();
+	msg.time = 0;
 	res = msgsnd(queue, &msg, msgsize, 0);
 	if (res == -1) {
 		perror("msgsnd");
 		exit(EXIT_FAILURE);
 	}
 	
-	res = msgrcv(queue, &msg, msgsize, CLIENTID, 0);
+	res = msgrcv(queue, &msg, msgsize, REGISTERED(getpid()), 0);
 	if (res == -1) {
 		perror("msgrcv");
 		exit(EXIT_FAILURE);
@@ -65,6 +67,15 @@ int main() {
 		exit(EXIT_FAILURE);
 	}
 
+				/* queue of the shard */
+
+	if (SHARD(client) != 0) {
+		key = ftok(KEYFILE, TIMESERVER + SHARD(client));
+		res = msgget(key, 0700);
+		if (res != -1)
+			queue = res;
+	}
+
 				/* sleep */
 
 	msg.mtype = SLEEP;
@@ -93,12 +104,13 @@ int main() {
 
 	msg.mtype = QUERY;
 	msg.client = client;
+	msg.time = REALTIME;
 	res = msgsnd(queue, &msg, msgsize, 0);
 	if (res == -1) {
 		perror("msgsnd");
 		exit(EXIT_FAILURE);
 	}
-	res = msgrcv(queue, &msg, msgsize, TIME, 0);
+	res = msgrcv(queue, &msg, msgsize, TIME(client), 0);
 	if (res == -1) {
 		perror("msgrcv");
 		exit(EXIT_FAILURE);
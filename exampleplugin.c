@@ -0,0 +1,76 @@
+/*
+ * exampleplugin.c
+ *
+ * example plugin of the timeserver
+ *
+ * timeserver -P ./exampleplugin.so[:step]
+ *
+ * time jumps by at most step seconds at each timeout, default 10, so that the
+ * clients that are running see the time pass in steps instead of a single
+ * jump to the next wakeup; the queries never advance the time, only the
+ * timeouts do; the clients due at the same time are woken from the most
+ * recent process to the oldest; the messages are counted by type, and printed
+ * at the end
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#define NOMSG
+#include "timecontrol.h"
+#include "timeplugin.h"
+
+/* static, not to bind to the symbols of the c library, like step() */
+static long step;
+static long events[TOSERVER], queries, jumps;
+
+int timeplugin_init(struct timeplugin *p, char *arg) {
+	(void) p;
+	step = arg == NULL ? 10 : atol(arg);
+	return step > 0 ? TIMEPLUGIN_VERSION : -1;
+}
+
+void timeplugin_event(struct timeplugin *p, long mtype, long client,
+		long time) {
+	(void) p;
+	(void) client;
+	(void) time;
+	if (mtype >= 0 && mtype < TOSERVER)
+		events[mtype]++;
+}
+
+long timeplugin_query(struct timeplugin *p, long client, long advance) {
+	(void) p;
+	(void) client;
+	(void) advance;
+	queries++;
+	return 0;
+}
+
+long timeplugin_jump(struct timeplugin *p, long next, int timeout) {
+	(void) timeout;
+	jumps++;
+	return next > *p->now + step ? *p->now + step : next;
+}
+
+static struct timeplugin *sorting;
+
+static int newest(const void *a, const void *b) {
+	long pa, pb;
+
+	pa = sorting->pids[*(long *) a];
+	pb = sorting->pids[*(long *) b];
+	return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+void timeplugin_order(struct timeplugin *p, long *clients, int n) {
+	sorting = p;
+	qsort(clients, n, sizeof(long), newest);
+}
+
+void timeplugin_fini(struct timeplugin *p) {
+	(void) p;
+	printf("plugin: queries=%ld jumps=%ld sleeps=%ld cancels=%ld "
+		"registers=%ld\n", queries, jumps, events[SLEEP],
+		events[CANCEL], events[REGISTER]);
+}
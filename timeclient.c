@@ -22,19 +22,217 @@
 #include <string.h>
 #include <stdarg.h>
 #include <fcntl.h>
+#include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/shm.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <stdint.h>
+#include <linux/io_uring.h>
+#include <linux/futex.h>
 
 #include "timecontrol.h"
 
 /*
- * number of queue and client, log file
+ * number of queue, client and clock domain, log file
  */
 int queue;
 long client;
+long domain;
+long lasttime;
 char logfile[1000];
 char *timeclient;
 
+/*
+ * registration is done at the first call about time, so that the processes
+ * that never make one, like the shells, grep and sed run by cron and by
+ * scripts, cost nothing to the timeserver; registered is 1 after registering,
+ * -1 if the timeserver could not be reached, 0 before trying
+ */
+int registered;
+void registerclient();
+void unregisterclient();
+
+/*
+ * dispatch of the functions about time: to the simulated ones once
+ * registered; to the real ones if the timeserver cannot be reached or the
+ * simulation is off for this process, so that these calls cost nothing; to
+ * the unbound ones before the first call, which register and choose
+ *
+ * the simulation is off if the environment variable TIMECLIENT is "off", and
+ * can be switched at runtime by timeclient_simulate()
+ */
+struct timefunctions {
+	unsigned int (* sleep)(unsigned int seconds);
+	int (* nanosleep)(const struct timespec *req, struct timespec *rem);
+	time_t (* time)(time_t *tloc);
+	int (* gettimeofday)(struct timeval *restrict tp, void *restrict tzp);
+	int (* clock_gettime)(clockid_t clock_id, struct timespec *tp);
+	int (* clock_nanosleep)(clockid_t clock_id, int flags,
+		const struct timespec *req, struct timespec *rem);
+	int (* usleep)(useconds_t usec);
+};
+struct timefunctions real, simulated, unbound;
+struct timefunctions *functions = &unbound;
+int simulate;
+
+/*
+ * statistics
+ *
+ * with TIMECLIENTSTATS=file, the calls to each intercepted function are
+ * counted by thread, with their total and maximal latency and a histogram by
+ * powers of ten; each thread takes a slot at its first call and is the only
+ * one writing it, so that no lock is needed; the threads beyond MAXSTATTHREADS
+ * share the last slot, and their counts are approximate
+ *
+ * the sums over the threads are appended to the file when the process exits
+ * or executes another program, and on the signal TIMECLIENTSTATSSIGNAL if
+ * given; each dump has the calls since the previous one; the log is counted
+ * as a function of its own, to tell its cost from the round trips
+ */
+#define STATTIME 0
+#define STATSLEEP 1
+#define STATNANOSLEEP 2
+#define STATGETTIMEOFDAY 3
+#define STATCLOCKGETTIME 4
+#define STATCLOCKNANOSLEEP 5
+#define STATUSLEEP 6
+#define STATFORK 7
+#define STATEXECVE 8
+#define STATIOURING 9
+#define STATLOG 10
+#define NUMSTATS 11
+#define NUMBUCKETS 8		/* under 1us, 10us... 1s, and more */
+#define MAXSTATTHREADS 256
+
+char *statnames[NUMSTATS] = {
+	"time", "sleep", "nanosleep", "gettimeofday", "clock_gettime",
+	"clock_nanosleep", "usleep", "fork", "execve", "io_uring_enter", "log"
+};
+
+struct stats {
+	long calls[NUMSTATS];
+	long nsec[NUMSTATS];
+	long max[NUMSTATS];
+	long buckets[NUMSTATS][NUMBUCKETS];
+} threadstats[MAXSTATTHREADS];
+int numthreadstats;
+__thread struct stats *stats;
+char statsfile[1000];
+
+long statsnow() {
+	struct timespec ts;
+
+	real.clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+long statstart() {
+	return statsfile[0] == '\0' ? 0 : statsnow();
+}
+
+void statend(int function, long start) {
+	long nsec, limit;
+	int slot, b;
+
+	if (start == 0)
+		return;
+	nsec = statsnow() - start;
+
+	if (stats == NULL) {
+		slot = __atomic_fetch_add(&numthreadstats, 1,
+			__ATOMIC_RELAXED);
+		stats = &threadstats[slot < MAXSTATTHREADS ?
+			slot : MAXSTATTHREADS - 1];
+	}
+
+	stats->calls[function]++;
+	stats->nsec[function] += nsec;
+	if (nsec > stats->max[function])
+		stats->max[function] = nsec;
+	for (b = 0, limit = 1000; b < NUMBUCKETS - 1 && nsec >= limit; b++)
+		limit *= 10;
+	stats->buckets[function][b]++;
+}
+
+void statsreset() {
+	memset(threadstats, 0, sizeof(threadstats));
+	numthreadstats = 0;
+	stats = NULL;
+}
+
+/*
+ * a line for each function called: pid, command, function, calls, total and
+ * maximal microseconds, then the calls under 1us, 10us... 1s, and above
+ */
+void statsdump() {
+	struct stats sum;
+	int saved, fd, n, t, f, b, len;
+	char command[20], line[300];
+	mode_t m;
+
+	if (statsfile[0] == '\0')
+		return;
+	saved = errno;
+
+	memset(&sum, 0, sizeof(sum));
+	n = numthreadstats < MAXSTATTHREADS ? numthreadstats : MAXSTATTHREADS;
+	for (t = 0; t < n; t++)
+		for (f = 0; f < NUMSTATS; f++) {
+			sum.calls[f] += threadstats[t].calls[f];
+			sum.nsec[f] += threadstats[t].nsec[f];
+			if (threadstats[t].max[f] > sum.max[f])
+				sum.max[f] = threadstats[t].max[f];
+			for (b = 0; b < NUMBUCKETS; b++)
+				sum.buckets[f][b] += threadstats[t].buckets[f][b];
+		}
+	for (t = 0; t < n; t++)
+		memset(&threadstats[t], 0, sizeof(struct stats));
+
+	fd = open("/proc/self/comm", O_RDONLY);
+	len = fd == -1 ? -1 : read(fd, command, 19);
+	if (fd != -1)
+		close(fd);
+	if (len <= 0)
+		strcpy(command, "-");
+	else
+		command[command[len - 1] == '\n' ? len - 1 : len] = '\0';
+	for (len = 0; command[len] != '\0'; len++)
+		if (command[len] == ' ')
+			command[len] = '_';
+
+	m = umask(0);
+	fd = open(statsfile,
+	          O_WRONLY | O_CREAT | O_APPEND,
+	          S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH);
+	umask(m);
+	if (fd == -1) {
+		errno = saved;
+		return;
+	}
+	for (f = 0; f < NUMSTATS; f++) {
+		if (sum.calls[f] == 0)
+			continue;
+		len = snprintf(line, 300, "%d %s %s %ld %ld %ld",
+			getpid(), command, statnames[f], sum.calls[f],
+			sum.nsec[f] / 1000, sum.max[f] / 1000);
+		for (b = 0; b < NUMBUCKETS; b++)
+			len += snprintf(line + len, 300 - len, " %ld",
+				sum.buckets[f][b]);
+		len += snprintf(line + len, 300 - len, "\n");
+		write(fd, line, len);
+	}
+	close(fd);
+	errno = saved;
+}
+
+void statssignal(int sig) {
+	(void) sig;
+	statsdump();
+}
+
 /*
  * logging
  *
@@ -55,7 +253,9 @@ int logprintf(char *fmt, ...) {
 	int fd;
 	char line[500];
 	va_list va;
+	long start;
 
+	start = statstart();
 	m = umask(0);
 	fd = open(logfile,
 	          O_WRONLY | O_CREAT | O_APPEND,
@@ -72,30 +272,152 @@ int logprintf(char *fmt, ...) {
 	va_end(va);
 
 	close(fd);
+	statend(STATLOG, start);
 	return 0;
 }
 
 /*
  * original system calls
  */
-unsigned int (* sleep_orig)(unsigned int seconds);
-int (* nanosleep_orig)(const struct timespec *req, struct timespec *rem);
-time_t (*time_orig)(time_t *tloc);
-int (* gettimeofday_orig)(struct timeval *restrict tp, void *restrict tzp);
-int (* clock_gettime_orig)(clockid_t clock_id, struct timespec *tp);
-
 pid_t (* fork_orig)(void);
 void (* _exit_orig)(int status);
 void (* exit_group_orig)(int status);
 int (* execve_orig)(const char *filename, char *const argv[],
 	char *const envp[]);
-int (* execle_orig)(const char *filename, const char *arg, ...);
+int (* execvpe_orig)(const char *file, char *const argv[],
+	char *const envp[]);
+long (* syscall_orig)(long number, ...);
+int (* close_orig)(int fd);
 
 /*
- * new system calls for time
+ * bind the functions at the first call about time
+ */
+void bindfunctions() {
+	if (simulate && registered == 0)
+		registerclient();
+	functions = simulate && registered == 1 ? &simulated : &real;
+}
+
+/*
+ * the timeserver is gone: use the real functions from now on
+ */
+void lost() {
+	if (errno != EINVAL && errno != EIDRM)
+		return;
+	logprintf("%d:\t\ttimeserver lost\n", getpid());
+	registered = -1;
+	functions = &real;
+}
+
+/*
+ * broadcast wakeups
+ *
+ * a client that can read the state of the timeserver is woken without a
+ * message: the server counts its wakeups in the state and releases the
+ * futex of the bucket of the client (see timecontrol.h); the client reads its
+ * count before sleeping, and waits on the bucket until the count changes; the
+ * bucket does not depend on the wakeup time, which only the server knows for
+ * a relative sleep
+ */
+struct timestate *state;
+long *stateclients, *statewakeups;
+int broadcasting;
+
+/*
+ * the wakeups of this client so far; the count to pass to woken() and
+ * broadcastwait() after sending a sleep
+ */
+long wakeupcount() {
+	return broadcasting ?
+		__atomic_load_n(&statewakeups[client], __ATOMIC_ACQUIRE) : 0;
+}
+
+/*
+ * whether the wakeup arrived, without waiting; -1 on error
+ */
+int woken(long count) {
+	if (broadcasting) {
+		if (__atomic_load_n(&statewakeups[client], __ATOMIC_ACQUIRE) ==
+		    count)
+			return 0;
+		lasttime = state->domains[domain].origin +
+			state->domains[domain].now;
+		return 1;
+	}
+	if (msgrcv(queue, &msg, msgsize, WAKE(client), IPC_NOWAIT) == -1)
+		return errno == ENOMSG ? 0 : -1;
+	lasttime = msg.time;
+	return 1;
+}
+
+/*
+ * wait a broadcast wakeup; -1 if interrupted by a signal or if the server is
+ * gone, which is checked every second
+ */
+int broadcastwait(long count) {
+	struct timespec ts;
+	struct msqid_ds ds;
+	unsigned int *bucket, value;
+
+	bucket = &state->buckets[WAKEBUCKET(client)];
+	while (1) {
+		value = __atomic_load_n(bucket, __ATOMIC_ACQUIRE);
+		if (woken(count))
+			return 0;
+
+		ts.tv_sec = 1;
+		ts.tv_nsec = 0;
+		if (syscall_orig(SYS_futex, bucket, FUTEX_WAIT, value, &ts,
+				NULL, 0) == -1) {
+			if (errno == EINTR)
+				return -1;
+			if (errno == ETIMEDOUT && msgctl(queue, IPC_STAT, &ds) == -1)
+				return -1;
+		}
+	}
+}
+
+/*
+ * query the current time of a clock, REALTIME or MONOTONIC, from the server;
+ * return -1 if the server cannot be reached
+ */
+long querytime(long clock) {
+	int res;
+	pid_t pid;
+
+	pid = getpid();
+
+	msg.mtype = QUERY;
+	msg.client = client;
+	msg.time = clock;
+	res = msgsnd(queue, &msg, msgsize, 0);
+	if (res == -1) {
+		logprintf("%d:\t\tquery, msgsnd: %s\n", pid, strerror(errno));
+		lost();
+		return -1;
+	}
+	res = msgrcv(queue, &msg, msgsize, TIME(client), 0);
+	if (res == -1) {
+		logprintf("%d:\t\tquery, msgrcv: %s\n", pid, strerror(errno));
+		lost();
+		return -1;
+	}
+
+	if (clock == REALTIME)
+		lasttime = msg.time;
+	return msg.time;
+}
+
+/*
+ * simulated functions
+ *
+ * every reply of the server carries the time, kept in lasttime; a sleep is a
+ * single round trip: the reply to a CANCEL tells the seconds left, so that the
+ * time is not asked before and after sleeping; the cache does not answer
+ * time(), since other clients may advance the time between two replies
  */
 
-void cancel() {
+long cancel() {
 	int res;
 
 	logprintf("%d: cancel()\n", getpid());
@@ -105,7 +427,7 @@ void cancel() {
 	res = msgsnd(queue, &msg, msgsize, 0);
 	if (res == -1) {
 		logprintf("\tmsgsnd: %s\n", strerror(errno));
-		return;
+		return 0;
 	}
 
 	/* here we really need the wakeup message before returning, since the
@@ -116,119 +438,1162 @@ void cancel() {
 		if (res == -1)
 			logprintf("\tmsgrcv: %s\n", strerror(errno));
 	} while (res == -1 && errno == EINTR);
+	if (res == -1)
+		return 0;
+
+	lasttime = msg.time;
+	return msg.client;
+}
+
+/*
+ * sleep by a message SLEEP for a number of seconds, or SLEEPUNTIL or
+ * SLEEPUNTILMONO until a time; return the seconds left if interrupted by a
+ * signal, -1 if the server cannot be reached
+ */
+long simulated_wait(long mtype, long time) {
+	int res;
+	long left, count;
+	pid_t pid;
+
+	pid = getpid();
+
+	count = wakeupcount();
+	msg.mtype = mtype;
+	msg.client = client;
+	msg.time = time;
+	res = msgsnd(queue, &msg, msgsize, 0);
+	if (res == -1) {
+		logprintf("\tmsgsnd: %s\n", strerror(errno));
+		lost();
+		return -1;
+	}
+
+	if (broadcasting)
+		res = broadcastwait(count);
+	else {
+		res = msgrcv(queue, &msg, msgsize, WAKE(client), 0);
+		if (res != -1)
+			lasttime = msg.time;
+	}
+	if (res == -1) {
+		logprintf("%d:\t\tsleep, msgrcv: %s\n", pid, strerror(errno));
+
+		if (errno != EINTR) {
+			lost();
+			return -1;
+		}
+		
+		left = cancel();
+		logprintf("%d:\t\tsleep, left: %ld at %ld\n", pid, left,
+			lasttime);
+		return left;
+	}
+
+	logprintf("%d: woken(%ld): %ld\n", pid, time, lasttime);
+
+	return 0;
+}
+
+unsigned int simulated_sleep(unsigned int seconds) {
+	long left;
+
+	logprintf("%d: sleep(%u)\n", getpid(), seconds);
+
+	left = simulated_wait(SLEEP, seconds);
+	if (left == -1) {
+		logprintf("\treal sleep(%d)\n", seconds);
+		return real.sleep(seconds);
+	}
+	return left;
+}
+
+int simulated_nanosleep(const struct timespec *req, struct timespec *rem) {
+	int res;
+
+	logprintf("%d: nanosleep(%d,...)\n", getpid(), req->tv_sec);
+
+	res = simulated_sleep(req->tv_sec + (req->tv_nsec > 0));
+	if (res == 0)
+		return 0;
+
+	if (rem != NULL) {
+		rem->tv_sec = res;
+		rem->tv_nsec = 121;
+	}
+	return -1;
+}
+
+/*
+ * a sleep until a time of a clock is a single message, so that the deadline
+ * does not drift by the time taken to ask the time; a fraction of second is
+ * rounded up, since the clocks read a deadline as passed only the second
+ * after, and a sleep of zero would not advance the time; the cpu-time clocks
+ * are not simulated
+ */
+int simulated_clock_nanosleep(clockid_t clock_id, int flags,
+		const struct timespec *req, struct timespec *rem) {
+	long mtype, time, left;
+
+	logprintf("%d: clock_nanosleep(%d,%d,%ld)\n", getpid(), clock_id,
+		flags, req->tv_sec);
+
+	switch (clock_id) {
+	case CLOCK_REALTIME:
+	case CLOCK_REALTIME_ALARM:
+	case CLOCK_TAI:
+		mtype = SLEEPUNTIL;
+		break;
+	case CLOCK_MONOTONIC:
+	case CLOCK_BOOTTIME:
+	case CLOCK_BOOTTIME_ALARM:
+		mtype = SLEEPUNTILMONO;
+		break;
+	default:
+		return real.clock_nanosleep(clock_id, flags, req, rem);
+	}
+
+	time = req->tv_sec + (req->tv_nsec > 0);
+	if (! (flags & TIMER_ABSTIME))
+		mtype = SLEEP;
+
+	left = simulated_wait(mtype, time);
+	if (left == -1)
+		return real.clock_nanosleep(clock_id, flags, req, rem);
+	if (left == 0)
+		return 0;
+
+	if (rem != NULL && ! (flags & TIMER_ABSTIME)) {
+		rem->tv_sec = left;
+		rem->tv_nsec = 121;
+	}
+	return EINTR;
+}
+
+int simulated_usleep(useconds_t usec) {
+	long left;
+
+	logprintf("%d: usleep(%u)\n", getpid(), usec);
+
+	left = simulated_wait(SLEEP, (usec + 999999) / 1000000);
+	if (left == -1)
+		return real.usleep(usec);
+	if (left == 0)
+		return 0;
+
+	errno = EINTR;
+	return -1;
+}
+
+time_t simulated_time(time_t *tloc) {
+	long t;
+	pid_t pid;
+
+	pid = getpid();
+	logprintf("%d: time()\n", pid);
+
+	t = querytime(REALTIME);
+	if (t == -1)
+		return real.time(tloc);
+
+	logprintf("%d: time(): %ld\n", pid, t);
+
+	if (tloc)
+		*tloc = t;
+	return t;
+}
+
+int simulated_gettimeofday(struct timeval *restrict tp, void *restrict tzp) {
+	time_t t;
+
+	t = simulated_time(NULL);
+
+	if (tp) {
+		tp->tv_sec = t;
+		tp->tv_usec = 12;
+	}
+	if (tzp) {
+		/* unspecified behavior, this is */
+		(void) tzp;
+	}
+
+	return 0;
+}
+
+/*
+ * the realtime clocks are the simulated time, the monotonic ones count from
+ * the start of the simulation; the cpu-time clocks and the others are not
+ * simulated, and are served locally without asking the server
+ */
+int simulated_clock_gettime(clockid_t clock_id, struct timespec *tp) {
+	long t;
+
+	switch (clock_id) {
+	case CLOCK_REALTIME:
+	case CLOCK_REALTIME_COARSE:
+	case CLOCK_REALTIME_ALARM:
+	case CLOCK_TAI:
+		t = querytime(REALTIME);
+		break;
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_RAW:
+	case CLOCK_MONOTONIC_COARSE:
+	case CLOCK_BOOTTIME:
+	case CLOCK_BOOTTIME_ALARM:
+		t = querytime(MONOTONIC);
+		break;
+	default:
+		return real.clock_gettime(clock_id, tp);
+	}
+
+	logprintf("%d: clock_gettime(%d): %ld\n", getpid(), clock_id, t);
+
+	if (t == -1)
+		return real.clock_gettime(clock_id, tp);
+
+	tp->tv_sec = t;
+	tp->tv_nsec = 1234;
+
+	return 0;
+}
+
+struct timefunctions simulated = {
+	simulated_sleep,
+	simulated_nanosleep,
+	simulated_time,
+	simulated_gettimeofday,
+	simulated_clock_gettime,
+	simulated_clock_nanosleep,
+	simulated_usleep
+};
+
+/*
+ * unbound functions
+ */
+
+unsigned int unbound_sleep(unsigned int seconds) {
+	bindfunctions();
+	return functions->sleep(seconds);
+}
+
+int unbound_nanosleep(const struct timespec *req, struct timespec *rem) {
+	bindfunctions();
+	return functions->nanosleep(req, rem);
+}
+
+time_t unbound_time(time_t *tloc) {
+	bindfunctions();
+	return functions->time(tloc);
+}
+
+int unbound_gettimeofday(struct timeval *restrict tp, void *restrict tzp) {
+	bindfunctions();
+	return functions->gettimeofday(tp, tzp);
+}
+
+int unbound_clock_gettime(clockid_t clock_id, struct timespec *tp) {
+	bindfunctions();
+	return functions->clock_gettime(clock_id, tp);
+}
+
+int unbound_clock_nanosleep(clockid_t clock_id, int flags,
+		const struct timespec *req, struct timespec *rem) {
+	bindfunctions();
+	return functions->clock_nanosleep(clock_id, flags, req, rem);
+}
+
+int unbound_usleep(useconds_t usec) {
+	bindfunctions();
+	return functions->usleep(usec);
+}
+
+struct timefunctions unbound = {
+	unbound_sleep,
+	unbound_nanosleep,
+	unbound_time,
+	unbound_gettimeofday,
+	unbound_clock_gettime,
+	unbound_clock_nanosleep,
+	unbound_usleep
+};
+
+/*
+ * new system calls for time
+ */
+
+unsigned int sleep(unsigned int seconds) {
+	long start;
+	unsigned int res;
+
+	start = statstart();
+	res = functions->sleep(seconds);
+	statend(STATSLEEP, start);
+	return res;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+	long start;
+	int res;
+
+	start = statstart();
+	res = functions->nanosleep(req, rem);
+	statend(STATNANOSLEEP, start);
+	return res;
+}
+
+time_t time(time_t *tloc) {
+	long start;
+	time_t res;
+
+	start = statstart();
+	res = functions->time(tloc);
+	statend(STATTIME, start);
+	return res;
+}
+
+int gettimeofday(struct timeval *restrict tp, void *restrict tzp) {
+	long start;
+	int res;
+
+	start = statstart();
+	res = functions->gettimeofday(tp, tzp);
+	statend(STATGETTIMEOFDAY, start);
+	return res;
+}
+
+int clock_gettime(clockid_t clock_id, struct timespec *tp) {
+	long start;
+	int res;
+
+	start = statstart();
+	res = functions->clock_gettime(clock_id, tp);
+	statend(STATCLOCKGETTIME, start);
+	return res;
+}
+
+int clock_nanosleep(clockid_t clock_id, int flags, const struct timespec *req,
+		struct timespec *rem) {
+	long start;
+	int res;
+
+	start = statstart();
+	res = functions->clock_nanosleep(clock_id, flags, req, rem);
+	statend(STATCLOCKNANOSLEEP, start);
+	return res;
+}
+
+int usleep(useconds_t usec) {
+	long start;
+	int res;
+
+	start = statstart();
+	res = functions->usleep(usec);
+	statend(STATUSLEEP, start);
+	return res;
+}
+
+/*
+ * io_uring
+ *
+ * the programs waiting through io_uring call none of the functions above:
+ * their timeouts are requests submitted to a ring, and their waits are
+ * io_uring_enter() with a timeout argument; syscall() is intercepted for
+ * io_uring_setup() and io_uring_enter(), and each ring is mapped again here
+ * to read the requests before the kernel does
+ *
+ * a timeout is rewritten into a nop that posts no completion, and its
+ * simulated deadline is kept here; a linked timeout is rewritten the same way
+ * and unlinked from its request, which is cancelled at the deadline with
+ * IORING_REGISTER_SYNC_CANCEL; the removals and updates of these timeouts are
+ * done here; a wait that a simulated deadline may end is a SLEEPUNTILMONO to
+ * the timeserver, while the ring is polled for the real completions, which
+ * cancel the sleep; at the deadline, the completion of the timeout is posted
+ * to the ring of the program by IORING_OP_MSG_RING from a private ring, with
+ * -ETIME as the kernel does
+ *
+ * not simulated: the timeouts counting completions, the multishot ones and
+ * those in a chain of requests; the rings polled by a kernel thread, those in
+ * memory of the program and those used by their registered index; the
+ * programs entering the kernel by themselves instead of syscall(), like
+ * liburing built without --use-libc; the timeouts complete only while the
+ * program waits in io_uring_enter(); like nanosleep(), the fractions of second
+ * are rounded up to the next second
+ */
+#define MAXRINGS 16
+#define MAXURINGTIMEOUTS 256
+#define URINGPOLLMIN 50			/* microseconds */
+#define URINGPOLLMAX 10000
+
+/* newer than some headers */
+#ifndef IORING_SETUP_NO_MMAP
+#define IORING_SETUP_NO_MMAP (1U << 14)
+#endif
+#ifndef IORING_SETUP_NO_SQARRAY
+#define IORING_SETUP_NO_SQARRAY (1U << 16)
+#endif
+#ifndef IORING_TIMEOUT_MULTISHOT
+#define IORING_TIMEOUT_MULTISHOT (1U << 6)
+#endif
+#ifndef IORING_ENTER_ABS_TIMER
+#define IORING_ENTER_ABS_TIMER (1U << 5)
+#endif
+
+struct ring {
+	int fd;
+	void *map;			/* NULL if the entry is free */
+	size_t mapsize;
+	struct io_uring_sqe *sqes;
+	size_t sqessize;
+	size_t sqesize;
+	unsigned *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned *cqhead, *cqtail, *cqmask;
+	struct io_uring_cqe *cqes;
+	size_t cqesize;
+} rings[MAXRINGS], msgring;
+
+struct uringtimeout {
+	struct ring *ring;
+	__u64 user_data;
+	int linked;			/* a linked timeout, of request */
+	__u64 request;
+	long deadline;			/* simulated, monotonic */
+} uringtimeouts[MAXURINGTIMEOUTS];
+int numuringtimeouts;
+
+/*
+ * map a ring; -1 if it is of a kind not simulated
+ */
+int ringmap(struct ring *r, int fd, struct io_uring_params *p) {
+	size_t sqsize, cqsize;
+	char *map;
+
+	if (p->flags & (IORING_SETUP_SQPOLL | IORING_SETUP_NO_MMAP) ||
+	    ! (p->features & IORING_FEAT_SINGLE_MMAP) ||
+	    ! (p->features & IORING_FEAT_EXT_ARG) ||
+	    ! (p->features & IORING_FEAT_CQE_SKIP))
+		return -1;
+
+	r->sqesize = p->flags & IORING_SETUP_SQE128 ? 128 : 64;
+	r->cqesize = p->flags & IORING_SETUP_CQE32 ? 32 : 16;
+	sqsize = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+	cqsize = p->cq_off.cqes + p->cq_entries * r->cqesize;
+	r->mapsize = sqsize > cqsize ? sqsize : cqsize;
+	r->sqessize = p->sq_entries * r->sqesize;
+
+	map = mmap(NULL, r->mapsize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	if (map == MAP_FAILED)
+		return -1;
+	r->sqes = mmap(NULL, r->sqessize, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED) {
+		munmap(map, r->mapsize);
+		return -1;
+	}
+
+	r->fd = fd;
+	r->map = map;
+	r->sqhead = (unsigned *) (map + p->sq_off.head);
+	r->sqtail = (unsigned *) (map + p->sq_off.tail);
+	r->sqmask = (unsigned *) (map + p->sq_off.ring_mask);
+	r->sqarray = p->flags & IORING_SETUP_NO_SQARRAY ? NULL :
+		(unsigned *) (map + p->sq_off.array);
+	r->cqhead = (unsigned *) (map + p->cq_off.head);
+	r->cqtail = (unsigned *) (map + p->cq_off.tail);
+	r->cqmask = (unsigned *) (map + p->cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe *) (map + p->cq_off.cqes);
+	return 0;
+}
+
+void ringunmap(struct ring *r) {
+	int i;
+
+	for (i = numuringtimeouts - 1; i >= 0; i--)
+		if (uringtimeouts[i].ring == r)
+			uringtimeouts[i] = uringtimeouts[--numuringtimeouts];
+	munmap(r->map, r->mapsize);
+	munmap(r->sqes, r->sqessize);
+	r->map = NULL;
+}
+
+struct ring *ringfind(int fd) {
+	int i;
+
+	for (i = 0; i < MAXRINGS; i++)
+		if (rings[i].map != NULL && rings[i].fd == fd)
+			return &rings[i];
+	return NULL;
+}
+
+struct io_uring_sqe *ringsqe(struct ring *r, unsigned i) {
+	unsigned index;
+
+	index = i & *r->sqmask;
+	if (r->sqarray != NULL)
+		index = r->sqarray[index];
+	return (struct io_uring_sqe *) ((char *) r->sqes + index * r->sqesize);
+}
+
+struct io_uring_cqe *ringcqe(struct ring *r, unsigned i) {
+	return (struct io_uring_cqe *)
+		((char *) r->cqes + (i & *r->cqmask) * r->cqesize);
+}
+
+unsigned ringready(struct ring *r) {
+	return __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE) - *r->cqhead;
+}
+
+/*
+ * the child of a fork shares the rings of its parent, but not its timeouts
+ * nor the private ring
+ */
+void uringreset() {
+	numuringtimeouts = 0;
+	if (msgring.map == NULL)
+		return;
+	close_orig(msgring.fd);
+	ringunmap(&msgring);
+}
+
+/*
+ * post a completion to a ring of the program
+ */
+int uringpost(int fd, __u64 user_data, int res) {
+	struct io_uring_params p;
+	struct io_uring_sqe *sqe;
+	unsigned tail, head;
+	int ringfd;
+
+	logprintf("%d: io_uring post(%d,%llu,%d)\n", getpid(), fd,
+		(unsigned long long) user_data, res);
+
+	if (msgring.map == NULL) {
+		memset(&p, 0, sizeof(p));
+		ringfd = syscall_orig(SYS_io_uring_setup, 1, &p);
+		if (ringfd == -1 || ringmap(&msgring, ringfd, &p) == -1) {
+			logprintf("\tprivate ring: %s\n", strerror(errno));
+			if (ringfd != -1)
+				close_orig(ringfd);
+			return -1;
+		}
+	}
+
+	tail = *msgring.sqtail;
+	sqe = (struct io_uring_sqe *) ((char *) msgring.sqes +
+		(tail & *msgring.sqmask) * msgring.sqesize);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_MSG_RING;
+	sqe->fd = fd;
+	sqe->addr = IORING_MSG_DATA;
+	sqe->off = user_data;
+	sqe->len = res;
+	msgring.sqarray[tail & *msgring.sqmask] = tail & *msgring.sqmask;
+	__atomic_store_n(msgring.sqtail, tail + 1, __ATOMIC_RELEASE);
+
+	if (syscall_orig(SYS_io_uring_enter, msgring.fd, 1, 0, 0, NULL, 0) == -1)
+		logprintf("\tio_uring_enter: %s\n", strerror(errno));
+	head = *msgring.cqhead;
+	while (ringready(&msgring) == 0)
+		if (syscall_orig(SYS_io_uring_enter, msgring.fd, 0, 1,
+				IORING_ENTER_GETEVENTS, NULL, 0) == -1 &&
+		    errno != EINTR) {
+			logprintf("\tio_uring_enter: %s\n", strerror(errno));
+			return -1;
+		}
+	res = ringcqe(&msgring, head)->res;
+	__atomic_store_n(msgring.cqhead, head + 1, __ATOMIC_RELEASE);
+	if (res < 0)
+		logprintf("\tmsg_ring: %s\n", strerror(-res));
+	return res;
+}
+
+struct uringtimeout *uringfind(struct ring *r, __u64 user_data) {
+	int i;
+
+	for (i = 0; i < numuringtimeouts; i++)
+		if (uringtimeouts[i].ring == r &&
+		    uringtimeouts[i].user_data == user_data)
+			return &uringtimeouts[i];
+	return NULL;
+}
+
+void uringdelete(struct uringtimeout *t) {
+	*t = uringtimeouts[--numuringtimeouts];
+}
+
+/*
+ * complete the timeouts of a ring due at a simulated time; a linked timeout
+ * cancels its request, and only fires if it was still running
+ */
+void uringfire(struct ring *r, long now) {
+	struct io_uring_sync_cancel_reg reg;
+	struct uringtimeout *t;
+	int i, res;
+
+	for (i = numuringtimeouts - 1; i >= 0; i--) {
+		t = &uringtimeouts[i];
+		if (t->ring != r || t->deadline > now)
+			continue;
+		res = -ETIME;
+		if (t->linked) {
+			memset(&reg, 0, sizeof(reg));
+			reg.addr = t->request;
+			reg.timeout.tv_sec = -1;
+			reg.timeout.tv_nsec = -1;
+			if (syscall_orig(SYS_io_uring_register, r->fd,
+					IORING_REGISTER_SYNC_CANCEL,
+					&reg, 1) == -1)
+				res = -ECANCELED;
+		}
+		uringpost(r->fd, t->user_data, res);
+		uringdelete(t);
+	}
+}
+
+/*
+ * the requests of the linked timeouts that completed by themselves: their
+ * timeouts complete with -ECANCELED
+ */
+void uringlinked(struct ring *r) {
+	struct uringtimeout *t;
+	unsigned head, tail, j;
+	int i;
+
+	head = *r->cqhead;
+	tail = __atomic_load_n(r->cqtail, __ATOMIC_ACQUIRE);
+	for (i = numuringtimeouts - 1; i >= 0; i--) {
+		t = &uringtimeouts[i];
+		if (t->ring != r || ! t->linked)
+			continue;
+		for (j = head; j != tail; j++)
+			if (ringcqe(r, j)->user_data == t->request)
+				break;
+		if (j == tail)
+			continue;
+		uringpost(r->fd, t->user_data, -ECANCELED);
+		uringdelete(t);
+	}
+}
+
+/*
+ * simulated deadline of a timespec of a request; a fraction of second rounds
+ * up like in the sleeps, so that a short timeout advances the time; a
+ * realtime deadline needs the simulated realtime, asked only then
+ */
+long uringdeadline(struct __kernel_timespec *ts, unsigned flags, long now) {
+	long seconds, realtime;
+
+	seconds = ts->tv_sec + (ts->tv_nsec > 0);
+	if (! (flags & IORING_TIMEOUT_ABS))
+		return now + seconds;
+	if (! (flags & IORING_TIMEOUT_REALTIME))
+		return seconds;
+	realtime = querytime(REALTIME);
+	return realtime == -1 ? now : now + seconds - realtime;
+}
+
+/*
+ * a request replaced by a nop, which posts its completion with result 0
+ * unless skip
+ */
+void uringnop(struct io_uring_sqe *sqe, int skip) {
+	__u64 user_data;
+	__u8 flags;
+
+	user_data = sqe->user_data;
+	flags = sqe->flags & (IOSQE_IO_DRAIN | IOSQE_IO_LINK | IOSQE_IO_HARDLINK);
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = IORING_OP_NOP;
+	sqe->flags = flags | (skip ? IOSQE_CQE_SKIP_SUCCESS : 0);
+	sqe->user_data = user_data;
+}
+
+void uringadd(struct ring *r, __u64 user_data, int linked, __u64 request,
+		long deadline) {
+	struct uringtimeout *t;
+
+	t = &uringtimeouts[numuringtimeouts++];
+	t->ring = r;
+	t->user_data = user_data;
+	t->linked = linked;
+	t->request = request;
+	t->deadline = deadline;
+	logprintf("%d: io_uring timeout(%llu): %ld\n", getpid(),
+		(unsigned long long) user_data, deadline);
+}
+
+/*
+ * rewrite the requests not yet read by the kernel; the time is asked only if
+ * there is a timeout among them
+ */
+void uringscan(struct ring *r) {
+	struct io_uring_sqe *sqe, *prev;
+	struct uringtimeout *t;
+	unsigned i, tail;
+	__u8 chain;
+	long now;
+
+	chain = IOSQE_IO_LINK | IOSQE_IO_HARDLINK;
+	now = -1;
+	prev = NULL;
+	tail = *r->sqtail;
+	for (i = __atomic_load_n(r->sqhead, __ATOMIC_ACQUIRE); i != tail;
+	     prev = sqe, i++) {
+		sqe = ringsqe(r, i);
+		switch (sqe->opcode) {
+		case IORING_OP_TIMEOUT:
+			if (sqe->off != 0 || sqe->flags & chain ||
+			    (prev != NULL && prev->flags & chain) ||
+			    sqe->timeout_flags & IORING_TIMEOUT_MULTISHOT)
+				break;
+			/* fall through */
+		case IORING_OP_LINK_TIMEOUT:
+			if (sqe->opcode == IORING_OP_LINK_TIMEOUT &&
+			    (prev == NULL || ! (prev->flags & IOSQE_IO_LINK) ||
+			     sqe->flags & chain))
+				break;
+			if (numuringtimeouts == MAXURINGTIMEOUTS)
+				break;
+			if (now == -1 && (now = querytime(MONOTONIC)) == -1)
+				return;
+			uringadd(r, sqe->user_data,
+				sqe->opcode == IORING_OP_LINK_TIMEOUT,
+				prev == NULL ? 0 : prev->user_data,
+				uringdeadline((struct __kernel_timespec *)
+					(uintptr_t) sqe->addr,
+					sqe->timeout_flags, now));
+			if (sqe->opcode == IORING_OP_LINK_TIMEOUT)
+				prev->flags &= ~IOSQE_IO_LINK;
+			uringnop(sqe, 1);
+			break;
+		case IORING_OP_TIMEOUT_REMOVE:
+			t = uringfind(r, sqe->addr);
+			if (t == NULL)
+				break;
+			if (sqe->timeout_flags & (IORING_TIMEOUT_UPDATE |
+					IORING_LINK_TIMEOUT_UPDATE)) {
+				if (now == -1 &&
+				    (now = querytime(MONOTONIC)) == -1)
+					return;
+				t->deadline = uringdeadline(
+					(struct __kernel_timespec *)
+					(uintptr_t) sqe->addr2,
+					sqe->timeout_flags, now);
+			}
+			else {
+				uringpost(r->fd, t->user_data, -ECANCELED);
+				uringdelete(t);
+			}
+			uringnop(sqe, 0);
+			break;
+		case IORING_OP_ASYNC_CANCEL:
+			if (sqe->cancel_flags != 0)
+				break;
+			t = uringfind(r, sqe->addr);
+			if (t == NULL)
+				break;
+			uringpost(r->fd, t->user_data, -ECANCELED);
+			uringdelete(t);
+			uringnop(sqe, 0);
+			break;
+		}
+	}
+}
+
+/*
+ * wait for min completions until the simulated deadlines: the timeouts of
+ * the ring, and end if not -1; returns like io_uring_enter(), with the number
+ * of requests submitted
+ */
+long uringwait(struct ring *r, long submitted, unsigned min, long end,
+		__u64 sigmask, __u32 sigmasksize) {
+	struct io_uring_getevents_arg arg;
+	struct __kernel_timespec ts;
+	struct msqid_ds ds;
+	long now, next, poll, count;
+	int i, res;
+	pid_t pid;
+
+	pid = getpid();
+	while (1) {
+		uringlinked(r);
+		if (ringready(r) >= min)
+			return submitted;
+
+		now = querytime(MONOTONIC);
+		if (now == -1) {
+			uringfire(r, LONG_MAX);
+			return submitted;
+		}
+		uringfire(r, now);
+		if (ringready(r) >= min)
+			return submitted;
+		if (end != -1 && now >= end) {
+			if (submitted > 0)
+				return submitted;
+			errno = ETIME;
+			return -1;
+		}
+
+		next = end;
+		for (i = 0; i < numuringtimeouts; i++)
+			if (uringtimeouts[i].ring == r &&
+			    (next == -1 || uringtimeouts[i].deadline < next))
+				next = uringtimeouts[i].deadline;
+		logprintf("%d: io_uring wait(%u): %ld\n", pid, min, next - now);
+
+		count = wakeupcount();
+		msg.mtype = SLEEPUNTILMONO;
+		msg.client = client;
+		msg.time = next;
+		if (msgsnd(queue, &msg, msgsize, 0) == -1) {
+			logprintf("\tmsgsnd: %s\n", strerror(errno));
+			lost();
+			uringfire(r, LONG_MAX);
+			return submitted;
+		}
+
+		/* the kernel is polled for the real completions, more and
+		 * more rarely, since the wakeup is usually quick */
+		for (poll = URINGPOLLMIN; ; poll = poll * 2 < URINGPOLLMAX ?
+				poll * 2 : URINGPOLLMAX) {
+			res = woken(count);
+			if (res == 1)
+				break;
+			if (res == -1 || (broadcasting && poll == URINGPOLLMAX &&
+			                  msgctl(queue, IPC_STAT, &ds) == -1)) {
+				logprintf("\twakeup: %s\n", strerror(errno));
+				lost();
+				uringfire(r, LONG_MAX);
+				return submitted;
+			}
+
+			ts.tv_sec = 0;
+			ts.tv_nsec = poll * 1000;
+			arg.sigmask = sigmask;
+			arg.sigmask_sz = sigmasksize;
+			arg.pad = 0;
+			arg.ts = (__u64) (uintptr_t) &ts;
+			res = syscall_orig(SYS_io_uring_enter, r->fd, 0, min,
+				IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG,
+				&arg, sizeof(arg));
+			if (res == -1 && errno == EINTR) {
+				cancel();
+				if (submitted > 0)
+					return submitted;
+				errno = EINTR;
+				return -1;
+			}
+			uringlinked(r);
+			if (ringready(r) >= min) {
+				cancel();
+				return submitted;
+			}
+		}
+	}
 }
 
-unsigned int sleep(unsigned int seconds) {
-	int res;
-	long start, left;
-	pid_t pid;
+long uringsetup(long entries, struct io_uring_params *p) {
+	struct ring *r;
+	long fd;
+	int i;
 
-	pid = getpid();
-	logprintf("%d: sleep(%u)\n", pid, seconds);
+	fd = syscall_orig(SYS_io_uring_setup, entries, p);
+	if (fd == -1)
+		return -1;
 
-	start = time(NULL);
+	/* a ring closed without close() leaves its entry */
+	r = ringfind(fd);
+	if (r != NULL)
+		ringunmap(r);
+	for (i = 0; i < MAXRINGS && rings[i].map != NULL; i++)
+		;
+	if (i == MAXRINGS || ringmap(&rings[i], fd, p) == -1)
+		logprintf("%d: io_uring_setup(): %ld not simulated\n",
+			getpid(), fd);
+	else
+		logprintf("%d: io_uring_setup(): %ld\n", getpid(), fd);
+	return fd;
+}
 
-	msg.mtype = SLEEP;
-	msg.client = client;
-	msg.time = seconds;
-	res = msgsnd(queue, &msg, msgsize, 0);
-	if (res == -1) {
-		logprintf("\tmsgsnd: %s\n", strerror(errno));
-		logprintf("\tsleep_orig(%d)\n", seconds);
-		return sleep_orig(seconds);
-	}
+long uringenter(long fd, long submit, long min, long flags, void *arg,
+		long argsize) {
+	struct io_uring_getevents_arg *ext;
+	struct __kernel_timespec *ts;
+	struct ring *r;
+	long submitted, end, res, start;
+	__u64 sigmask;
+	__u32 sigmasksize;
+	int i;
 
-	res = msgrcv(queue, &msg, msgsize, WAKE(client), 0);
-	if (res == -1) {
-		logprintf("%d:\t\tsleep, msgrcv: %s\n", pid, strerror(errno));
+	r = flags & IORING_ENTER_REGISTERED_RING ? NULL : ringfind(fd);
+	if (r == NULL)
+		return syscall_orig(SYS_io_uring_enter, fd, submit, min, flags,
+			arg, argsize);
+
+	start = statstart();
+	if (functions == &unbound)
+		bindfunctions();
+	if (functions != &simulated) {
+		uringfire(r, LONG_MAX);
+		res = syscall_orig(SYS_io_uring_enter, fd, submit, min, flags,
+			arg, argsize);
+		statend(STATIOURING, start);
+		return res;
+	}
 
-		if (errno != EINTR)
-			return sleep_orig(seconds);
-		
-		cancel();
-		left = start + seconds - time(NULL);
-		logprintf("%d:\t\tsleep, left: %d\n", pid, left);
-		return left;
+	if (submit > 0)
+		uringscan(r);
+	uringlinked(r);
+
+	ts = NULL;
+	sigmask = (__u64) (uintptr_t) arg;
+	sigmasksize = argsize;
+	if (flags & IORING_ENTER_EXT_ARG) {
+		ext = arg;
+		ts = (struct __kernel_timespec *) (uintptr_t) ext->ts;
+		sigmask = ext->sigmask;
+		sigmasksize = ext->sigmask_sz;
+	}
+	for (i = 0; i < numuringtimeouts && uringtimeouts[i].ring != r; i++)
+		;
+	if (! (flags & IORING_ENTER_GETEVENTS) || min == 0 ||
+	    flags & IORING_ENTER_ABS_TIMER ||
+	    (ts == NULL && i == numuringtimeouts)) {
+		res = syscall_orig(SYS_io_uring_enter, fd, submit, min, flags,
+			arg, argsize);
+		statend(STATIOURING, start);
+		return res;
 	}
 
-	logprintf("%d: woken(%u): %ld\n", pid, seconds, msg.time);
+	submitted = syscall_orig(SYS_io_uring_enter, fd, submit, 0,
+		flags & ~(IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG),
+		NULL, 0);
+	if (submitted == -1) {
+		statend(STATIOURING, start);
+		return -1;
+	}
 
-	return 0;
+	end = -1;
+	if (ts != NULL) {
+		end = querytime(MONOTONIC);
+		if (end != -1)
+			end += ts->tv_sec + (ts->tv_nsec > 0);
+	}
+	res = uringwait(r, submitted, min, end, sigmask, sigmasksize);
+	statend(STATIOURING, start);
+	return res;
 }
 
-int nanosleep(const struct timespec *req, struct timespec *rem) {
-	int res;
+/*
+ * the system calls made through syscall(), as liburing does when built with
+ * --use-libc; the arguments not passed are read anyway, as syscall() itself
+ * does
+ */
+long syscall(long number, ...) {
+	va_list va;
+	long a[6];
+	int i;
 
-	logprintf("%d: nanosleep(%d,...)\n", getpid(), req->tv_sec);
+	va_start(va, number);
+	for (i = 0; i < 6; i++)
+		a[i] = va_arg(va, long);
+	va_end(va);
 
-	res = sleep(req->tv_sec);
-	if (res == 0)
-		return 0;
+	if (syscall_orig == NULL)
+		syscall_orig = dlsym(RTLD_NEXT, "syscall");
 
-	if (rem != NULL) {
-		rem->tv_sec = res;
-		rem->tv_nsec = 121;
+	switch (number) {
+	case SYS_io_uring_setup:
+		return uringsetup(a[0], (struct io_uring_params *) a[1]);
+	case SYS_io_uring_enter:
+		return uringenter(a[0], a[1], a[2], a[3], (void *) a[4], a[5]);
 	}
-	return -1;
+	return syscall_orig(number, a[0], a[1], a[2], a[3], a[4], a[5]);
 }
 
-time_t time(time_t *tloc) {
-	int res;
-	pid_t pid;
+/*
+ * a ring closed is not simulated anymore; the private ring is made again if
+ * the program closes it
+ */
+int close(int fd) {
+	struct ring *r;
+
+	if (close_orig == NULL)
+		close_orig = dlsym(RTLD_NEXT, "close");
+	r = ringfind(fd);
+	if (r != NULL)
+		ringunmap(r);
+	if (msgring.map != NULL && msgring.fd == fd)
+		ringunmap(&msgring);
+	return close_orig(fd);
+}
 
-	pid = getpid();
-	logprintf("%d: time()\n", pid);
+/*
+ * switch the simulation on or off for this process, returning whether it was
+ * on; a program preloaded with timeclient.so finds it with dlsym(); the
+ * process unregisters when switched off, and registers again at the first
+ * call about time when switched on
+ */
+int timeclient_simulate(int on) {
+	int previous;
+
+	previous = simulate;
+	simulate = on;
+	if (! on)
+		unregisterclient();
+	functions = on ? &unbound : &real;
+	return previous;
+}
 
-	msg.mtype = QUERY;
-	msg.client = client;
-	res = msgsnd(queue, &msg, msgsize, 0);
-	if (res == -1) {
-		logprintf("%d:\t\ttime, msgrcv: %s\n", pid, strerror(errno));
-		return time_orig(tloc);
-	}
-	res = msgrcv(queue, &msg, msgsize, TIME, 0);
-	if (res == -1) {
-		logprintf("%d:\t\ttime, msgrcv: %s\n", pid, strerror(errno));
-		return time_orig(tloc);
-	}
+/*
+ * client registration and unregistration
+ */
 
-	logprintf("%d: time(): %ld\n", pid, msg.time);
+/*
+ * order of the process among the children of its parent still alive, which
+ * the kernel lists in order of creation; it tells apart the identical
+ * siblings, like the same program started many times by a shell
+ */
+long spawnordinal() {
+	DIR *dir;
+	struct dirent *e;
+	FILE *f;
+	char path[300];
+	long ordinal, pid;
+	int found;
+
+	snprintf(path, 300, "/proc/%d/task", getppid());
+	dir = opendir(path);
+	if (dir == NULL)
+		return 0;
 
-	return msg.time;
+	ordinal = 0;
+	found = 0;
+	while (! found && (e = readdir(dir)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, 300, "/proc/%d/task/%s/children", getppid(),
+			e->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		while (! found && fscanf(f, "%ld", &pid) == 1) {
+			if (pid == getpid())
+				found = 1;
+			else
+				ordinal++;
+		}
+		fclose(f);
+	}
+	closedir(dir);
+	return found ? ordinal : 0;
 }
 
-int gettimeofday(struct timeval *restrict tp, void *restrict tzp) {
-	time_t t;
+/*
+ * tag of the client: a hash of the command line, of the id of the parent and
+ * of the order among its siblings, used by the timeserver to recognize the
+ * client when replaying a simulation
+ */
+long clienttag() {
+	int fd, len, i;
+	char buf[1000];
+	unsigned long hash;
+
+	hash = 2166136261UL;
+	fd = open("/proc/self/cmdline", O_RDONLY);
+	if (fd != -1) {
+		len = read(fd, buf, 1000);
+		for (i = 0; i < len; i++)
+			hash = (hash ^ (unsigned char) buf[i]) * 16777619UL;
+		close(fd);
+	}
+	hash = (hash ^ (unsigned long) client) * 16777619UL;
+	hash = (hash ^ (unsigned long) spawnordinal()) * 16777619UL;
+	return hash & 0x7FFFFFFF;
+}
 
-	t = time(NULL);
+/*
+ * switch to the queue of the shard of the client; a timerelay forwards all
+ * messages from the main queue, and does not create the queues of the shards
+ */
+void shardqueue() {
+	key_t key;
+	int res;
 
-	if (tp) {
-		tp->tv_sec = t;
-		tp->tv_usec = 12;
-	}
-	if (tzp) {
-		/* unspecified behavior, this is */
-		(void) tzp;
-	}
+	if (SHARD(client) == 0)
+		return;
 
-	return 0;
+	key = ftok(KEYFILE, TIMESERVER + SHARD(client));
+	res = key == -1 ? -1 : msgget(key, 0700);
+	if (res != -1)
+		queue = res;
+	else
+		logprintf("%d:\t\tshard %ld: %s\n", getpid(),
+			SHARD(client), strerror(errno));
 }
 
-int clock_gettime(clockid_t clock_id, struct timespec *tp) {
-	time_t t;
-
-	(void) clock_id;
+/*
+ * move to the clock domain in TIMEDOMAIN, if not the first; the reply tells
+ * the domain, unchanged if the timeserver does not have it
+ */
+void domainclient() {
+	char *env;
+	long wanted;
+	int res;
 
-	t = time(NULL);
-	tp->tv_sec = t;
-	tp->tv_nsec = 1234;
+	domain = 0;
+	env = getenv("TIMEDOMAIN");
+	wanted = env == NULL ? 0 : atol(env);
+	if (wanted == 0)
+		return;
 
-	return 0;
+	msg.mtype = DOMAIN;
+	msg.client = client;
+	msg.time = wanted;
+	if (msgsnd(queue, &msg, msgsize, 0) == -1)
+		return;
+	do {
+		res = msgrcv(queue, &msg, msgsize, TIME(client), 0);
+	} while (res == -1 && errno == EINTR);
+	if (res == -1)
+		return;
+	domain = msg.client;
+	lasttime = msg.time;
+	logprintf("%d: domain(%ld): %ld\n", getpid(), wanted, domain);
 }
 
 /*
- * client registration and unregistration
+ * ask to be woken by broadcast, if the state of the timeserver can be read;
+ * the server always accepts, since it has the state and the client is not
+ * behind a timerelay, whose host has none; no reply is waited
  */
+void broadcastclient() {
+	key_t key;
+	int id;
+
+	if (state == NULL) {
+		key = ftok(KEYFILE, TIMESERVER);
+		id = key == -1 ? -1 : shmget(key, 0, 0);
+		state = id == -1 ? (void *) -1 : shmat(id, NULL, SHM_RDONLY);
+		if (state == (void *) -1)
+			state = NULL;
+		else {
+			stateclients = STATECLIENTS(state);
+			statewakeups = STATEWAKEUPS(state);
+		}
+	}
+
+	broadcasting = 0;
+	if (state == NULL)
+		return;
+	msg.mtype = BROADCAST;
+	msg.client = client;
+	msg.time = 1;
+	if (msgsnd(queue, &msg, msgsize, 0) == -1)
+		return;
+	broadcasting = 1;
+	logprintf("%d: broadcast(): %d\n", getpid(), broadcasting);
+}
 
 void registerclient() {
 	key_t key;
@@ -237,6 +1602,7 @@ void registerclient() {
 
 	pid = getpid();
 	logprintf("%d: registerclient()\n", pid);
+	registered = -1;
 
 				/* open queue */
 
@@ -256,6 +1622,8 @@ void registerclient() {
 				/* request client number */
 
 	msg.mtype = REGISTER;
+	msg.client = pid;
+	msg.time = clienttag();
 	res = msgsnd(queue, &msg, msgsize, 0);
 	if (res == -1) {
 		logprintf("%d:\t\tmsgsnd: %s\n", pid, strerror(errno));
@@ -264,17 +1632,23 @@ void registerclient() {
 
 				/* obtain client id */
 
-	res = msgrcv(queue, &msg, msgsize, CLIENTID, 0);
+	res = msgrcv(queue, &msg, msgsize, REGISTERED(pid), 0);
 	if (res == -1) {
 		logprintf("%d:\t\tmsgrcv: %s\n", pid, strerror(errno));
 		return;
 	}
 	client = msg.client;
+	lasttime = msg.time;
 	logprintf("%d: client(): %ld\n", getpid(), client);
 	if (client == -1) {
 		logprintf("%d:\t\tcannot register\n", pid);
 		return;
 	}
+	registered = 1;
+
+				/* switch to the queue of the shard */
+
+	shardqueue();
 
 				/* send pid */
 
@@ -282,14 +1656,61 @@ void registerclient() {
 	msg.client = client;
 	msg.time = getpid();
 	msgsnd(queue, &msg, msgsize, 0);
+
+				/* clock domain */
+
+	domainclient();
+
+				/* wakeups by broadcast */
+
+	broadcastclient();
+}
+
+/*
+ * attach to the client id passed by the program executing this one
+ */
+void attachclient() {
+	char *env;
+	long id;
+	int pid;
+	key_t key;
+
+	env = getenv("TIMECLIENTID");
+	if (env == NULL || sscanf(env, "%ld:%d", &id, &pid) != 2 ||
+	    pid != getpid())
+		return;
+
+	key = ftok(KEYFILE, TIMESERVER);
+	queue = key == -1 ? -1 : msgget(key, 0700);
+	if (queue == -1) {
+		logprintf("%d:\t\tattach, msgget: %s\n", pid, strerror(errno));
+		return;
+	}
+
+	client = id;
+	registered = 1;
+	shardqueue();
+	logprintf("%d: attach(): %ld\n", pid, client);
+
+	/* the pid ends the lease of the id (see execve()) */
+	msg.mtype = PID;
+	msg.client = client;
+	msg.time = pid;
+	msgsnd(queue, &msg, msgsize, 0);
+
+	broadcastclient();
+
+	/* the timeserver knows the domain; the client reads it to sleep */
+	domain = state == NULL ? 0 : STATEDOMAINS(state)[client];
 }
 
 void unregisterclient() {
 	int res;
 	pid_t pid;
 
-	if (queue == -1)
+	if (registered != 1)
 		return;
+	registered = 0;
 
 	pid = getpid();
 	logprintf("%d: unregister(%ld)\n", pid, client);
@@ -309,18 +1730,27 @@ void unregisterclient() {
 
 pid_t fork(void) {
 	pid_t ret;
+	long start;
+
+	start = statstart();
 	logprintf("%d: fork()\n", getpid());
 	ret = fork_orig();
 	if (ret == 0) {
+		statsreset();
+		uringreset();
 		logprintf("%d: child\n", getpid());
-		registerclient();
+		registered = 0;
+		functions = simulate ? &unbound : &real;
 	}
+	else
+		statend(STATFORK, start);
 	return ret;
 }
 
 void _exit(int status) {
 	logprintf("%d: _exit(%d)\n", getpid(), status);
 	unregisterclient();
+	statsdump();
 	_exit_orig(status);
 	_exit(status);			/* avoid warning */
 }
@@ -328,6 +1758,7 @@ void _exit(int status) {
 void exit_group(int status) {
 	logprintf("%d: exit_group(%d)\n", getpid(), status);
 	unregisterclient();
+	statsdump();
 	exit_group_orig(status);
 	exit_group(status);		/* avoid warning */
 }
@@ -340,85 +1771,251 @@ int str2cmp(char *a, char *b) {
 	return memcmp(a, b, strlen(b));
 }
 
-int execve(const char *filename, char *const argv[],
-                  char *const envp[]) {
-	int i;
-	char **newenvp;
-	char ldpreload[1020], logfilename[1020];
-	int oldld, oldlog;
-	int res;
+/*
+ * the environment of a new program; the variables of this library are added
+ * again, since the program may pass an arbitrary environment; the client
+ * keeps its id and its pid in the new program in TIMECLIENTID=id:pid, so that
+ * the timeserver does not believe it ended in the meantime; the pid tells
+ * that it is for this process and not for a child that inherited it; the id
+ * is never in the environment of this process, only in that of the new
+ * program, so the processes that never registered do not pass one; the
+ * strings are static, since the process is replaced
+ */
+char envld[1020], envlog[1020], envkey[1020], envstatsfile[1020];
+char envdomain[100], envclientid[100];
 
-	logprintf("%d: execve(%s,...)\n", getpid(), filename);
-	for (i = 0; i == 0 || argv[i - 1]; i++)
-		logprintf("\targv[%d]: %s\n", i, argv[i]);
-	logprintf("\t------------\n");
+/*
+ * the timeserver keeps the id for the new program only for a lease, since it
+ * may never attach if it does not load this library (static, setuid); EXEC
+ * starts the lease, and PID ends it if exec fails, keeping its errno
+ */
+void execlease(long mtype) {
+	int err;
+
+	if (registered != 1)
+		return;
+	err = errno;
+	msg.mtype = mtype;
+	msg.client = client;
+	msg.time = getpid();
+	msgsnd(queue, &msg, msgsize, 0);
+	errno = err;
+}
+
+char **clientenv(char *const envp[]) {
+	int i, j;
+	char **newenvp;
+	int oldld, oldlog, oldkey, oldstats, olddomain;
 
 	oldld = 0;
 	oldlog = 0;
+	oldkey = getenv("TIMESERVERFILE") == NULL;
+	oldstats = statsfile[0] == '\0';
+	olddomain = getenv("TIMEDOMAIN") == NULL;
 	for (i = 0; i == 0 || envp[i - 1]; i++) {
 		logprintf("\tenvp[%d]: %s\n", i, envp[i]);
 		if (! str2cmp(envp[i], "LD_PRELOAD="))
 			oldld = 1;
 		if (! str2cmp(envp[i], "TIMECLIENTLOGFILE="))
 			oldlog = 1;
+		if (! str2cmp(envp[i], "TIMESERVERFILE="))
+			oldkey = 1;
+		if (! str2cmp(envp[i], "TIMECLIENTSTATS="))
+			oldstats = 1;
+		if (! str2cmp(envp[i], "TIMEDOMAIN="))
+			olddomain = 1;
 	}
 	logprintf("\t------------\n");
 
-	/* add LD_PRELOAD again, since the application may call
-	 * execve() with an arbitrary environment */
-
-	newenvp = malloc((i + 2) * sizeof(char *));
-	memcpy (newenvp, envp, i * sizeof(char *));
-	snprintf(ldpreload, 1020, "LD_PRELOAD=%s", timeclient);
-	snprintf(logfilename, 1020, "TIMECLIENTLOGFILE=%s", logfile);
-	i--;
+	newenvp = malloc((i + 6) * sizeof(char *));
+	if (newenvp == NULL)
+		return NULL;
+	for (i = 0, j = 0; envp[i]; i++)
+		if (str2cmp(envp[i], "TIMECLIENTID="))
+			newenvp[j++] = envp[i];
+	snprintf(envld, 1020, "LD_PRELOAD=%s", timeclient);
+	snprintf(envlog, 1020, "TIMECLIENTLOGFILE=%s", logfile);
+	snprintf(envkey, 1020, "TIMESERVERFILE=%s", KEYFILE);
+	snprintf(envstatsfile, 1020, "TIMECLIENTSTATS=%s", statsfile);
 	if (! oldld)
-		newenvp[i++] = ldpreload;
+		newenvp[j++] = envld;
 	if (! oldlog)
-		newenvp[i++] = logfilename;
-	newenvp[i++] = NULL;
+		newenvp[j++] = envlog;
+	if (! oldkey)
+		newenvp[j++] = envkey;
+	if (! oldstats)
+		newenvp[j++] = envstatsfile;
+	if (! olddomain) {
+		snprintf(envdomain, 100, "TIMEDOMAIN=%s",
+			getenv("TIMEDOMAIN"));
+		newenvp[j++] = envdomain;
+	}
+	if (registered == 1) {
+		snprintf(envclientid, 100, "TIMECLIENTID=%ld:%d",
+			client, getpid());
+		newenvp[j++] = envclientid;
+	}
+	newenvp[j++] = NULL;
 
 	for (i = 0; i == 0 || newenvp[i - 1]; i++)
 		logprintf("\tnewenvp[%d]: %s\n", i, newenvp[i]);
 
-	/* cannot keep client_id across an execve();
-	 * just unregister for now; if execve() fails, register again */
+	return newenvp;
+}
 
-	unregisterclient();
+int execve(const char *filename, char *const argv[],
+                  char *const envp[]) {
+	int i;
+	char **newenvp;
+	int res;
+	long start;
+
+	start = statstart();
+	logprintf("%d: execve(%s,...)\n", getpid(), filename);
+	for (i = 0; i == 0 || argv[i - 1]; i++)
+		logprintf("\targv[%d]: %s\n", i, argv[i]);
+	logprintf("\t------------\n");
+
+	newenvp = clientenv(envp);
+	if (newenvp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* the counts of this program are lost if it is replaced */
+	statend(STATEXECVE, start);
+	statsdump();
+
+	execlease(EXEC);
 	res = execve_orig(filename, argv, newenvp);
-	registerclient();
+	execlease(PID);
+	free(newenvp);
 	return res;
 }
 
-/* for some reason, redefining execve only is not enough */
-int execle(const char *path, const char *arg, ...) {
-	va_list ap;
+/*
+ * the other exec functions of the c library call its internal execve(), not
+ * the one above; they are redirected to it, or to the execvpe() of the
+ * library with the environment of the new program, which searches the path
+ */
+int execvpe(const char *file, char *const argv[], char *const envp[]) {
+	char **newenvp;
+	int res;
+	long start;
+
+	start = statstart();
+	logprintf("%d: execvpe(%s,...)\n", getpid(), file);
+
+	newenvp = clientenv(envp);
+	if (newenvp == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	statend(STATEXECVE, start);
+	statsdump();
+
+	execlease(EXEC);
+	res = execvpe_orig(file, argv, newenvp);
+	execlease(PID);
+	free(newenvp);
+	return res;
+}
+
+int execv(const char *path, char *const argv[]) {
+	return execve(path, argv, environ);
+}
+
+int execvp(const char *file, char *const argv[]) {
+	return execvpe(file, argv, environ);
+}
+
+/*
+ * the arguments of execl(), execlp() and execle() as an array
+ */
+char **execlargs(const char *arg, va_list *ap) {
 	char *s;
-	char **envp;
 	char **res, **argv;
 	int argn;
-	int err;
-
-	logprintf("%d: execle(%s,...)\n", getpid(), path);
 
 	argn = 1;
 	argv = malloc((argn + 1) * sizeof(char *));
+	if (argv == NULL)
+		return NULL;
 	argv[argn - 1] = (char *) arg;
-	va_start(ap, arg);
-	for (argn++; NULL != (s = va_arg(ap, char *)); argn++) {
+	for (argn++; NULL != (s = va_arg(*ap, char *)); argn++) {
 		res = realloc(argv, (argn + 1) * sizeof(char *));
 		if (res == NULL) {
-			va_end(ap);
 			free(argv);
-			errno = ENOMEM;
-			return -1;
+			return NULL;
 		}
 		argv = res;
 		argv[argn - 1] = s;
 	}
 	argv[argn - 1] = NULL;
-	envp = va_arg(ap, char **);
+	return argv;
+}
+
+int execl(const char *path, const char *arg, ...) {
+	va_list ap;
+	char **argv;
+	int err;
+
+	logprintf("%d: execl(%s,...)\n", getpid(), path);
+
+	va_start(ap, arg);
+	argv = execlargs(arg, &ap);
+	va_end(ap);
+	if (argv == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	execve(path, argv, environ);
+	err = errno;
+	free(argv);
+	errno = err;
+	return -1;
+}
+
+int execlp(const char *file, const char *arg, ...) {
+	va_list ap;
+	char **argv;
+	int err;
+
+	logprintf("%d: execlp(%s,...)\n", getpid(), file);
+
+	va_start(ap, arg);
+	argv = execlargs(arg, &ap);
+	va_end(ap);
+	if (argv == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	execvpe(file, argv, environ);
+	err = errno;
+	free(argv);
+	errno = err;
+	return -1;
+}
+
+int execle(const char *path, const char *arg, ...) {
+	va_list ap;
+	char **envp;
+	char **argv;
+	int err;
+
+	logprintf("%d: execle(%s,...)\n", getpid(), path);
+
+	va_start(ap, arg);
+	argv = execlargs(arg, &ap);
+	envp = argv == NULL ? NULL : va_arg(ap, char **);
 	va_end(ap);
+	if (argv == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
 
 	execve(path, argv, envp);
 	err = errno;
@@ -432,7 +2029,8 @@ int execle(const char *path, const char *arg, ...) {
  */
 
 static void __attribute__((constructor)) init() {
-	char *ldpreload, *envlogfile, cwd[1000];
+	char *ldpreload, *envlogfile, *envsimulate, *envstats, cwd[1000];
+	struct sigaction sa;
 
 	ldpreload = getenv("LD_PRELOAD");
 	if (ldpreload[0] != '.')
@@ -449,22 +2047,46 @@ static void __attribute__((constructor)) init() {
 	else
 		snprintf(logfile, 1000, "%s", envlogfile);
 
-	sleep_orig = dlsym(RTLD_NEXT, "sleep");
-	nanosleep_orig = dlsym(RTLD_NEXT, "nanosleep");
-	time_orig = dlsym(RTLD_NEXT, "time");
-	gettimeofday_orig = dlsym(RTLD_NEXT, "gettimeofday");
-	clock_gettime_orig = dlsym(RTLD_NEXT, "clock_gettime_orig");
+	real.sleep = dlsym(RTLD_NEXT, "sleep");
+	real.nanosleep = dlsym(RTLD_NEXT, "nanosleep");
+	real.time = dlsym(RTLD_NEXT, "time");
+	real.gettimeofday = dlsym(RTLD_NEXT, "gettimeofday");
+	real.clock_gettime = dlsym(RTLD_NEXT, "clock_gettime");
+	real.clock_nanosleep = dlsym(RTLD_NEXT, "clock_nanosleep");
+	real.usleep = dlsym(RTLD_NEXT, "usleep");
 
 	fork_orig = dlsym(RTLD_NEXT, "fork");
 	_exit_orig = dlsym(RTLD_NEXT, "_exit");
 	exit_group_orig = dlsym(RTLD_NEXT, "exit_group");
 	execve_orig = dlsym(RTLD_NEXT, "execve");
-	execle_orig = dlsym(RTLD_NEXT, "execle");
+	execvpe_orig = dlsym(RTLD_NEXT, "execvpe");
+	syscall_orig = dlsym(RTLD_NEXT, "syscall");
+	close_orig = dlsym(RTLD_NEXT, "close");
+
+	envstats = getenv("TIMECLIENTSTATS");
+	if (envstats != NULL)
+		snprintf(statsfile, 1000, "%s", envstats);
+	envstats = getenv("TIMECLIENTSTATSSIGNAL");
+	if (envstats != NULL && statsfile[0] != '\0') {
+		memset(&sa, 0, sizeof(sa));
+		sa.sa_handler = statssignal;
+		sa.sa_flags = SA_RESTART;
+		sigaction(atoi(envstats), &sa, NULL);
+	}
+
+	registered = 0;
+	attachclient();
 
-	registerclient();
+	envsimulate = getenv("TIMECLIENT");
+	simulate = envsimulate == NULL || strcmp(envsimulate, "off");
+	if (! simulate)
+		unregisterclient();
+	functions = ! simulate ? &real :
+		registered == 1 ? &simulated : &unbound;
 }
 
 static void __attribute__((destructor)) fini() {
 	unregisterclient();
+	statsdump();
 }
 
@@ -1,8 +1,14 @@
-#define KEYFILE "/dev/null"
+#define KEYFILE (getenv("TIMESERVERFILE") != NULL ? \
+	getenv("TIMESERVERFILE") : "/dev/null")
 #define TIMESERVER 45631
 
 /*
  * message types
+ *
+ * a client that executes another program sends EXEC, and the new program PID
+ * when it attaches to the same id; if it does not within a lease, the
+ * timeserver takes the id back by a LAPSED message of its own, only in its
+ * trace
  */
 #define NONE                0
 #define REGISTER            1
@@ -10,16 +16,53 @@
 #define PID                 3
 #define TIMEOUT             4
 #define RUN                 5
+#define BROADCAST           6
+#define DOMAIN              7
+#define EXEC                8
+#define LAPSED              9
 #define NOTRUNNING       1000
 
 #define QUERY            1001
 #define SLEEP            1002
 #define CANCEL           1003
+#define SLEEPUNTIL       1004
+#define SLEEPUNTILMONO   1005
 #define TOSERVER         2000
 
 #define CLIENTID         2001
-#define TIME             2002
 #define WAKE(client)    (3000 + (client))
+#define TIME(client)    (1000000 + (client))
+#define REGISTERED(pid) (100000000 + (pid))
+
+/*
+ * only in the trace of timeserver -r: a message about time that arrived while
+ * its domain is not running, recorded again when processed at the next run
+ */
+#define DEFERRED(mtype)  (2000000 + (mtype))
+
+/*
+ * a SLEEP is for a number of seconds; a SLEEPUNTIL and a SLEEPUNTILMONO are
+ * until a time of the REALTIME and of the MONOTONIC clock, so that the client
+ * needs not ask the time to compute the seconds
+ */
+#define ISSLEEP(mtype) \
+	((mtype) == SLEEP || (mtype) == SLEEPUNTIL || (mtype) == SLEEPUNTILMONO)
+
+/*
+ * clients in each shard of the timeserver; the id of a client tells its shard,
+ * whose queue is obtained from ftok(KEYFILE, TIMESERVER + shard); the ids are
+ * below MAXSHARDS * MAXCLIENTS
+ */
+#define MAXCLIENTS 200
+#define MAXSHARDS 64
+#define SHARD(client) ((client) / MAXCLIENTS)
+
+/*
+ * clock in the QUERY message: the time of the simulation, or the number of
+ * seconds since its start
+ */
+#define REALTIME  0
+#define MONOTONIC 1
 
 /*
  * in the RUN message, run up to the next client sleep or wakeup
@@ -28,12 +71,68 @@
 #define NEXTWAKE  -2
 
 /*
- * message structure
+ * clock domains: independent simulations in the same timeserver, each with
+ * its own time and runs; a client is in domain 0 unless it sends DOMAIN, RUN
+ * and TIMEOUT tell their domain in the client field
+ */
+#define MAXDOMAINS 16
+
+/*
+ * state of the timeserver, mirrored in a read-only shared memory segment
+ * obtained from ftok(KEYFILE, TIMESERVER); the header has the time of each
+ * domain, and is followed by five arrays of size longs: the state of each
+ * client, its pid, the number of messages it sent, the number of times it was
+ * woken and its domain; the state is EMPTY, RUNNING, or SLEEPING plus the
+ * wakeup time minus one
+ *
+ * the clients that sent BROADCAST are woken without a message: their count
+ * of wakeups increases, then a FUTEX_WAKE on the bucket of their id wakes at
+ * once all the clients due in it; a client knows its bucket before the server
+ * reads its sleep, even if relative
+ */
+#define EMPTY 0
+#define RUNNING 1
+#define SLEEPING 2
+
+#define WAKEBUCKETS 64
+#define WAKEBUCKET(t) ((((t) % WAKEBUCKETS) + WAKEBUCKETS) % WAKEBUCKETS)
+
+struct timedomain {
+	long now;
+	long end;
+	long origin;
+	long numclients;
+	long numsleeping;
+};
+
+struct timestate {
+	long numdomains;
+	long size;
+	unsigned int buckets[WAKEBUCKETS];	/* futexes */
+	struct timedomain domains[MAXDOMAINS];
+};
+#define STATECLIENTS(s)  ((long *) ((s) + 1))
+#define STATEPIDS(s)     (STATECLIENTS(s) + (s)->size)
+#define STATEMESSAGES(s) (STATEPIDS(s) + (s)->size)
+#define STATEWAKEUPS(s)  (STATEMESSAGES(s) + (s)->size)
+#define STATEDOMAINS(s)  (STATEWAKEUPS(s) + (s)->size)
+#define STATESIZE(size)  (sizeof(struct timestate) + 5 * (size) * sizeof(long))
+
+/*
+ * message structure; the variable msg is not defined in the modules that are
+ * linked with a program (NOMSG)
+ *
+ * every reply of the server carries the current simulated time, the clock
+ * asked for in TIME; in WAKE, client is the number of seconds left of the
+ * sleep, not zero only when answering a CANCEL
  */
-struct {
+struct timemsg {
 	long mtype;
 	long client;
 	long time;
-} msg;
-#define msgsize (sizeof(msg) - sizeof(long))
+};
+#ifndef NOMSG
+struct timemsg msg;
+#endif
+#define msgsize (sizeof(struct timemsg) - sizeof(long))
 
@@ -3,28 +3,737 @@
  *
  * calls another problem with timeclient.so as a preload library
  * before, search timeclient.so in a path
+ *
+ * timeexec [-s] [-l] [-c cgroup] [-d domain] program args...
+ *
+ * with -s, the program runs under a seccomp filter instead: its system calls
+ * nanosleep(), clock_nanosleep(), clock_gettime(), gettimeofday() and time()
+ * stop and are notified to timeexec, which answers them from the timeserver;
+ * this works also for static binaries and for runtimes that do not call the
+ * functions of the c library, like go
+ *
+ * the system calls are only made when the vdso does not serve the clocks;
+ * this is the case with vdso=0 on the kernel command line or with a
+ * clocksource that is not supported by the vdso; the calls for sleeping are
+ * always notified
+ *
+ * with -l, the preload library is timelocal.so, which keeps the simulated
+ * time in the program itself without a timeserver
+ *
+ * with -c, the program and its children run in the given cgroup v2 directory,
+ * the same as timeserver -c, which freezes them between the runs
+ *
+ * with -d, the program and its children are in the given clock domain of
+ * timeserver -d; it is passed to timeclient.so in TIMEDOMAIN
+ *
+ * each thread of the program and of its children is a client of the
+ * timeserver; a thread sleeping is waited by a thread of timeexec, so that the
+ * others can still be answered; timeexec unregisters the threads that die
  */
 
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <endian.h>
+#include <pthread.h>
 #include <sys/stat.h>
+#include <sys/msg.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <linux/seccomp.h>
+#include <linux/filter.h>
+#include <linux/audit.h>
+
+#define NOMSG
+#include "timecontrol.h"
 
 char *libpath = "/lib:/usr/lib:/usr/local/lib:.";
 char *timeclient = "timeclient.so";
 
+/*
+ * architecture of the system calls notified; the others are allowed
+ */
+#if defined(__x86_64__)
+#define ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define ARCH AUDIT_ARCH_AARCH64
+#elif defined(__i386__)
+#define ARCH AUDIT_ARCH_I386
+#else
+#define ARCH 0
+#endif
+
+/* some architectures have no time() system call */
+#ifndef SYS_time
+#define SYS_time SYS_nanosleep
+#endif
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+#define ARG0 offsetof(struct seccomp_data, args[0])
+#else
+#define ARG0 (offsetof(struct seccomp_data, args[0]) + 4)
+#endif
+
+/*
+ * the filter: notify the system calls for time and sleeping, but only for the
+ * simulated clocks; the cpu-time clocks (2, 3 and the negative ones) run, and
+ * so do clock 10, CLOCK_SGI_CYCLE, and those from 12 on, which the kernel
+ * rejects; the x32 system calls have the arch of x86_64 but numbers with
+ * __X32_SYSCALL_BIT, which match none of these: x32 programs are not
+ * supported, and run on real time
+ */
+struct sock_filter filter[] = {
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, arch)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, ARCH, 0, 12),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(struct seccomp_data, nr)),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_nanosleep, 9, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_gettimeofday, 8, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_time, 7, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_clock_gettime, 1, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SYS_clock_nanosleep, 0, 6),
+	BPF_STMT(BPF_LD | BPF_W | BPF_ABS, ARG0),
+	BPF_JUMP(BPF_JMP | BPF_JGE | BPF_K, 12, 4, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, CLOCK_PROCESS_CPUTIME_ID, 3, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, CLOCK_THREAD_CPUTIME_ID, 2, 0),
+	BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 10, 1, 0),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_USER_NOTIF),
+	BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),
+};
+
+/*
+ * the threads of the program that are clients of the timeserver
+ */
+#define MAXTRACED 1000
+
+struct traced {
+	pid_t pid;
+	long client;
+	int queue;
+	int sleeping;		/* waited by a thread of timeexec */
+	long mtype;		/* SLEEP, SLEEPUNTIL or SLEEPUNTILMONO */
+	long time;		/* seconds of SLEEP, deadline of the others */
+	__u64 id;		/* notification of the sleep */
+	pthread_t thread;
+} traced[MAXTRACED];
+
+int notifyfd;
+int mainqueue;
+long domain;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t awake = PTHREAD_COND_INITIALIZER;
+
+/*
+ * tag of a client, as in timeclient.so
+ */
+long tracedtag(pid_t pid) {
+	int fd, len, i;
+	char buf[1000];
+	unsigned long hash;
+
+	hash = 2166136261UL;
+	snprintf(buf, 1000, "/proc/%d/cmdline", pid);
+	fd = open(buf, O_RDONLY);
+	if (fd != -1) {
+		len = read(fd, buf, 1000);
+		for (i = 0; i < len; i++)
+			hash = (hash ^ (unsigned char) buf[i]) * 16777619UL;
+		close(fd);
+	}
+	hash = hash * 16777619UL;
+	return hash & 0x7FFFFFFF;
+}
+
+/*
+ * a thread is no longer sleeping
+ */
+void tracedawake(struct traced *t) {
+	pthread_mutex_lock(&lock);
+	t->sleeping = 0;
+	pthread_cond_broadcast(&awake);
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * a sleeping thread that makes a system call was interrupted; its sleep is
+ * cancelled before answering
+ */
+void tracedinterrupted(struct traced *t) {
+	struct timespec ts;
+
+	pthread_mutex_lock(&lock);
+	while (t->sleeping) {
+		pthread_kill(t->thread, SIGUSR1);
+		clock_gettime(CLOCK_REALTIME, &ts);
+		ts.tv_nsec += 100000000;
+		if (ts.tv_nsec >= 1000000000) {
+			ts.tv_sec++;
+			ts.tv_nsec -= 1000000000;
+		}
+		pthread_cond_timedwait(&awake, &lock, &ts);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * the client of a thread, registering it if new; NULL if the timeserver
+ * cannot be reached
+ */
+struct traced *tracedclient(pid_t pid) {
+	struct traced *t, *free;
+	struct timemsg m;
+	key_t key;
+	int res;
+
+	if (mainqueue == -1)
+		return NULL;
+
+	free = NULL;
+	pthread_mutex_lock(&lock);
+	for (t = traced; t < traced + MAXTRACED; t++) {
+		if (t->pid == pid) {
+			pthread_mutex_unlock(&lock);
+			tracedinterrupted(t);
+			return t;
+		}
+		if (t->pid == 0 && free == NULL)
+			free = t;
+	}
+	if (free == NULL) {
+		pthread_mutex_unlock(&lock);
+		fprintf(stderr, "too many threads\n");
+		return NULL;
+	}
+	t = free;
+	t->pid = pid;
+	t->sleeping = 0;
+	pthread_mutex_unlock(&lock);
+
+	m.mtype = REGISTER;
+	m.client = pid;
+	m.time = tracedtag(pid);
+	res = msgsnd(mainqueue, &m, msgsize, 0);
+	if (res != -1)
+		res = msgrcv(mainqueue, &m, msgsize, REGISTERED(pid), 0);
+	if (res == -1 || m.client == -1) {
+		t->pid = 0;
+		return NULL;
+	}
+	t->client = m.client;
+	t->queue = mainqueue;
+
+	if (SHARD(t->client) != 0) {
+		key = ftok(KEYFILE, TIMESERVER + SHARD(t->client));
+		res = key == -1 ? -1 : msgget(key, 0700);
+		if (res != -1)
+			t->queue = res;
+	}
+
+	/* no pid is sent: the thread may be no process, and the timeserver
+	 * would not find it; timeexec unregisters it when it dies */
+
+	if (domain != 0) {
+		m.mtype = DOMAIN;
+		m.client = t->client;
+		m.time = domain;
+		if (msgsnd(t->queue, &m, msgsize, 0) != -1)
+			msgrcv(t->queue, &m, msgsize, TIME(t->client), 0);
+	}
+
+	return t;
+}
+
+/*
+ * unregister a client that died
+ */
+void traceddead(struct traced *t) {
+	struct timemsg m;
+
+	m.mtype = UNREGISTER;
+	m.client = t->client;
+	msgsnd(t->queue, &m, msgsize, 0);
+	while (-1 != msgrcv(t->queue, &m, msgsize, WAKE(t->client),
+			IPC_NOWAIT))
+		;
+	t->pid = 0;
+}
+
+/*
+ * query the time of a clock; -1 on error
+ */
+long tracedtime(struct traced *t, long clock) {
+	struct timemsg m;
+
+	m.mtype = QUERY;
+	m.client = t->client;
+	m.time = clock;
+	if (msgsnd(t->queue, &m, msgsize, 0) == -1)
+		return -1;
+	if (msgrcv(t->queue, &m, msgsize, TIME(t->client), 0) == -1)
+		return -1;
+	return m.time;
+}
+
+/*
+ * the simulated clock a clock id is made from
+ */
+long clockof(long clock_id) {
+	switch (clock_id) {
+	case CLOCK_REALTIME:
+	case CLOCK_REALTIME_COARSE:
+	case CLOCK_REALTIME_ALARM:
+	case CLOCK_TAI:
+		return REALTIME;
+	default:
+		return MONOTONIC;
+	}
+}
+
+/*
+ * access the memory of a thread
+ */
+int peek(pid_t pid, __u64 addr, void *buf, size_t len) {
+	struct iovec local, remote;
+
+	local.iov_base = buf;
+	local.iov_len = len;
+	remote.iov_base = (void *) addr;
+	remote.iov_len = len;
+	return process_vm_readv(pid, &local, 1, &remote, 1, 0) ==
+		(ssize_t) len ? 0 : -1;
+}
+
+int poke(pid_t pid, __u64 addr, void *buf, size_t len) {
+	struct iovec local, remote;
+
+	if (addr == 0)
+		return 0;
+	local.iov_base = buf;
+	local.iov_len = len;
+	remote.iov_base = (void *) addr;
+	remote.iov_len = len;
+	return process_vm_writev(pid, &local, 1, &remote, 1, 0) ==
+		(ssize_t) len ? 0 : -1;
+}
+
+/*
+ * answer a notification: return val, or fail with error; with continue, the
+ * system call is executed as it is
+ */
+void respond(__u64 id, long val, int error, int cont) {
+	struct seccomp_notif_resp resp;
+
+	memset(&resp, 0, sizeof(resp));
+	resp.id = id;
+	resp.val = val;
+	resp.error = error;
+	resp.flags = cont ? SECCOMP_USER_NOTIF_FLAG_CONTINUE : 0;
+	ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_SEND, &resp);
+}
+
+/*
+ * wait the wakeup of a sleeping thread; timeexec signals these threads every
+ * second to check whether the sleep was interrupted
+ */
+void *sleeper(void *arg) {
+	struct traced *t;
+	struct timemsg m;
+	int res, dead;
+
+	t = (struct traced *) arg;
+
+	m.mtype = t->mtype;
+	m.client = t->client;
+	m.time = t->time;
+	if (msgsnd(t->queue, &m, msgsize, 0) == -1) {
+		respond(t->id, 0, 0, 1);
+		tracedawake(t);
+		return NULL;
+	}
+
+	while (-1 == msgrcv(t->queue, &m, msgsize, WAKE(t->client), 0)) {
+		if (errno != EINTR)
+			break;
+		if (ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_ID_VALID, &t->id) == 0)
+			continue;
+
+		/* the thread died, or the sleep was interrupted by a signal */
+
+		dead = kill(t->pid, 0) == -1 && errno == ESRCH;
+		if (dead) {
+			pthread_mutex_lock(&lock);
+			traceddead(t);
+			t->sleeping = 0;
+			pthread_mutex_unlock(&lock);
+			return NULL;
+		}
+
+		m.mtype = CANCEL;
+		m.client = t->client;
+		msgsnd(t->queue, &m, msgsize, 0);
+		do {
+			res = msgrcv(t->queue, &m, msgsize, WAKE(t->client), 0);
+		} while (res == -1 && errno == EINTR);
+		tracedawake(t);
+		return NULL;
+	}
+
+	respond(t->id, 0, 0, 0);
+	tracedawake(t);
+	return NULL;
+}
+
+void wakeup(int sig) {
+	(void) sig;
+}
+
+/*
+ * sleep a thread for some seconds, or until a time of a clock
+ */
+void tracedsleep(struct traced *t, __u64 id, long mtype, long time) {
+	pthread_attr_t attr;
+
+	pthread_mutex_lock(&lock);
+	t->sleeping = 1;
+	t->id = id;
+	t->mtype = mtype;
+	t->time = mtype == SLEEP && time < 0 ? 0 : time;
+	pthread_mutex_unlock(&lock);
+
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	if (pthread_create(&t->thread, &attr, sleeper, t) != 0) {
+		respond(id, 0, 0, 1);
+		tracedawake(t);
+	}
+	pthread_attr_destroy(&attr);
+}
+
+/*
+ * answer a system call of the program
+ */
+void notification() {
+	struct seccomp_notif req;
+	struct traced *t;
+	struct timespec ts;
+	struct timeval tv;
+	struct timezone tz;
+	long now;
+	__u64 *args;
+
+	memset(&req, 0, sizeof(req));
+	if (ioctl(notifyfd, SECCOMP_IOCTL_NOTIF_RECV, &req) == -1)
+		return;
+	args = req.data.args;
+
+	t = tracedclient(req.pid);
+	if (t == NULL) {
+		respond(req.id, 0, 0, 1);
+		return;
+	}
+
+	switch (req.data.nr) {
+	case SYS_clock_gettime:
+		now = tracedtime(t, clockof(args[0]));
+		if (now == -1)
+			break;
+		ts.tv_sec = now;
+		ts.tv_nsec = 1234;
+		if (poke(req.pid, args[1], &ts, sizeof(ts)) == -1)
+			respond(req.id, -1, -EFAULT, 0);
+		else
+			respond(req.id, 0, 0, 0);
+		return;
+
+	case SYS_gettimeofday:
+		now = tracedtime(t, REALTIME);
+		if (now == -1)
+			break;
+		tv.tv_sec = now;
+		tv.tv_usec = 12;
+		memset(&tz, 0, sizeof(tz));
+		if (poke(req.pid, args[0], &tv, sizeof(tv)) == -1 ||
+		    poke(req.pid, args[1], &tz, sizeof(tz)) == -1)
+			respond(req.id, -1, -EFAULT, 0);
+		else
+			respond(req.id, 0, 0, 0);
+		return;
+
+#if SYS_time != SYS_nanosleep
+	case SYS_time:
+		now = tracedtime(t, REALTIME);
+		if (now == -1)
+			break;
+		if (poke(req.pid, args[0], &now, sizeof(time_t)) == -1)
+			respond(req.id, -1, -EFAULT, 0);
+		else
+			respond(req.id, now, 0, 0);
+		return;
+#endif
+
+	case SYS_nanosleep:
+		if (peek(req.pid, args[0], &ts, sizeof(ts)) == -1) {
+			respond(req.id, -1, -EFAULT, 0);
+			return;
+		}
+		tracedsleep(t, req.id, SLEEP, ts.tv_sec + (ts.tv_nsec > 0));
+		return;
+
+	case SYS_clock_nanosleep:
+		if (peek(req.pid, args[2], &ts, sizeof(ts)) == -1) {
+			respond(req.id, -1, -EFAULT, 0);
+			return;
+		}
+		if (! (args[1] & TIMER_ABSTIME))
+			tracedsleep(t, req.id, SLEEP,
+				ts.tv_sec + (ts.tv_nsec > 0));
+		else
+			tracedsleep(t, req.id, clockof(args[0]) == REALTIME ?
+				SLEEPUNTIL : SLEEPUNTILMONO,
+				ts.tv_sec + (ts.tv_nsec > 0));
+		return;
+	}
+
+	respond(req.id, 0, 0, 1);
+}
+
+/*
+ * every second: unregister the threads that died, signal the threads waiting
+ * for the sleeping ones
+ */
+void housekeeping() {
+	struct traced *t;
+
+	pthread_mutex_lock(&lock);
+	for (t = traced; t < traced + MAXTRACED; t++) {
+		if (t->pid == 0)
+			continue;
+		if (t->sleeping)
+			pthread_kill(t->thread, SIGUSR1);
+		else if (kill(t->pid, 0) == -1 && errno == ESRCH)
+			traceddead(t);
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * pass the notification descriptor from the child to timeexec
+ */
+int sendfd(int sock, int fd) {
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char c, buf[CMSG_SPACE(sizeof(int))];
+
+	c = 0;
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = buf;
+	mh.msg_controllen = sizeof(buf);
+	cm = CMSG_FIRSTHDR(&mh);
+	cm->cmsg_level = SOL_SOCKET;
+	cm->cmsg_type = SCM_RIGHTS;
+	cm->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cm), &fd, sizeof(int));
+	return sendmsg(sock, &mh, 0);
+}
+
+int recvfd(int sock) {
+	struct msghdr mh;
+	struct iovec iov;
+	struct cmsghdr *cm;
+	char c, buf[CMSG_SPACE(sizeof(int))];
+	int fd;
+
+	iov.iov_base = &c;
+	iov.iov_len = 1;
+	memset(&mh, 0, sizeof(mh));
+	mh.msg_iov = &iov;
+	mh.msg_iovlen = 1;
+	mh.msg_control = buf;
+	mh.msg_controllen = sizeof(buf);
+	if (recvmsg(sock, &mh, 0) <= 0)
+		return -1;
+	cm = CMSG_FIRSTHDR(&mh);
+	if (cm == NULL || cm->cmsg_type != SCM_RIGHTS)
+		return -1;
+	memcpy(&fd, CMSG_DATA(cm), sizeof(int));
+	return fd;
+}
+
+/*
+ * run the program under the seccomp filter
+ */
+int seccompexec(char *argv[]) {
+	struct sock_fprog prog;
+	struct sigaction sa;
+	struct pollfd p;
+	int sv[2], fd, status, exited;
+	pid_t child;
+	time_t last;
+	key_t key;
+
+	if (ARCH == 0) {
+		printf("seccomp not supported on this architecture\n");
+		exit(EXIT_FAILURE);
+	}
+
+	key = ftok(KEYFILE, TIMESERVER);
+	mainqueue = key == -1 ? -1 : msgget(key, 0700);
+	if (mainqueue == -1)
+		perror("timeserver queue");
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv) == -1) {
+		perror("socketpair");
+		exit(EXIT_FAILURE);
+	}
+
+	child = fork();
+	if (child == -1) {
+		perror("fork");
+		exit(EXIT_FAILURE);
+	}
+	if (child == 0) {
+		close(sv[0]);
+		prog.len = sizeof(filter) / sizeof(filter[0]);
+		prog.filter = filter;
+		if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) == -1) {
+			perror("prctl");
+			_exit(EXIT_FAILURE);
+		}
+		fd = syscall(SYS_seccomp, SECCOMP_SET_MODE_FILTER,
+			SECCOMP_FILTER_FLAG_NEW_LISTENER, &prog);
+		if (fd == -1) {
+			perror("seccomp");
+			_exit(EXIT_FAILURE);
+		}
+		sendfd(sv[1], fd);
+		close(fd);
+		close(sv[1]);
+		execvp(argv[0], argv);
+		perror(argv[0]);
+		_exit(EXIT_FAILURE);
+	}
+
+	close(sv[1]);
+	notifyfd = recvfd(sv[0]);
+	close(sv[0]);
+	if (notifyfd == -1) {
+		waitpid(child, &status, 0);
+		exit(EXIT_FAILURE);
+	}
+
+	sa.sa_handler = wakeup;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGUSR1, &sa, NULL);
+
+				/* answer until no process uses the filter */
+
+	exited = 0;
+	status = 0;
+	last = time(NULL);
+	p.fd = notifyfd;
+	p.events = POLLIN;
+	while (1) {
+		if (poll(&p, 1, 1000) == -1 && errno != EINTR)
+			break;
+		if (! exited && waitpid(child, &status, WNOHANG) == child)
+			exited = 1;
+		if (p.revents & POLLIN)
+			notification();
+		else if (p.revents & (POLLHUP | POLLERR))
+			break;
+		if (time(NULL) != last) {
+			last = time(NULL);
+			housekeeping();
+		}
+	}
+
+	if (! exited)
+		waitpid(child, &status, 0);
+	housekeeping();
+	return WIFEXITED(status) ? WEXITSTATUS(status) :
+		128 + WTERMSIG(status);
+}
+
+/*
+ * move this process in a cgroup, where its children will be too
+ */
+int cgroupjoin(char *cgroup) {
+	char path[1000];
+	FILE *f;
+
+	snprintf(path, 1000, "%s/cgroup.procs", cgroup);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return -1;
+	}
+	fprintf(f, "%d\n", getpid());
+	if (fclose(f) == EOF) {
+		perror(path);
+		return -1;
+	}
+	return 0;
+}
+
 int main(int argn, char *argv[]) {
 	char *dlibpath, *dir, *libname;
-	int res;
+	int res, opt, seccomp;
 	struct stat sb;
 
-	if (argn - 1 < 1) {
+	seccomp = 0;
+	domain = 0;
+	while (-1 != (opt = getopt(argn, argv, "+slc:d:h"))) {
+		switch (opt) {
+		case 's':
+			seccomp = 1;
+			break;
+		case 'l':
+			timeclient = "timelocal.so";
+			break;
+		case 'c':
+			if (cgroupjoin(optarg) == -1)
+				exit(EXIT_FAILURE);
+			break;
+		case 'd':
+			domain = atol(optarg);
+			setenv("TIMEDOMAIN", optarg, 1);
+			break;
+		case 'h':
+		default:
+			printf("usage:\n\ttimeexec [-s] [-l] [-c cgroup] "
+				"[-d domain] program args...\n");
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+	}
+
+	if (argn - optind < 1) {
 		printf("no program given\n");
-		printf("usage:\n\ttimeexec program args...\n");
+		printf("usage:\n\ttimeexec [-s] [-l] [-c cgroup] "
+			"[-d domain] program args...\n");
 		exit(EXIT_FAILURE);
 	}
 
+	if (seccomp)
+		return seccompexec(argv + optind);
+
 	dlibpath = strdup(libpath);
 	for (dir = strtok(dlibpath, ":"); dir; dir = strtok(NULL, ":")) {
 		libname = malloc(strlen(dir) + strlen(timeclient) + 10);
@@ -45,6 +754,5 @@ int main(int argn, char *argv[]) {
 	setenv("LD_PRELOAD", libname, 1);
 	printf("LD_PRELOAD=%s\n", getenv("LD_PRELOAD"));
 
-	return execvp(argv[1], argv + 1);
+	return execvp(argv[optind], argv + optind);
 }
-
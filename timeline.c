@@ -0,0 +1,265 @@
+/*
+ * timeline.c
+ *
+ * convert a trace recorded by timeserver -r into a timeline in the trace
+ * event format of chrome and perfetto
+ *
+ * timeserver -r trace
+ * ...
+ * timeline trace > timeline.json
+ *
+ * the timeline has two processes: one on the wall-clock time, one on the
+ * simulated time; each has a track per client showing when it runs, sleeps or
+ * is blocked on a query waiting for the next timerun, and a track of the
+ * timeserver showing the idle timeouts and the instant jumps of time; with
+ * timeserver -d, the simulated times of all domains share the same track
+ *
+ * the trace is read line by line and the events are written as soon as they
+ * end, so that only the state of the clients is kept in memory
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdarg.h>
+
+#define NOMSG
+#include "timecontrol.h"
+
+/*
+ * the processes of the timeline
+ */
+#define WALL 1
+#define SIMULATED 2
+
+/*
+ * state of a client
+ */
+#define ABSENT 0
+#define ACTIVE 1
+#define SLEEPS 2
+#define BLOCKED 3
+
+char *statename[] = {"", "running", "sleeping", "blocked"};
+
+#define MAXIDS (MAXSHARDS * MAXCLIENTS)
+
+struct client {
+	int state;
+	long wall;		/* start of the state */
+	long simulated;
+} clients[MAXIDS];
+
+int first;
+
+/*
+ * output an event
+ */
+void event(char *fmt, ...) {
+	va_list va;
+
+	printf(first ? "\n" : ",\n");
+	first = 0;
+	va_start(va, fmt);
+	vprintf(fmt, va);
+	va_end(va);
+}
+
+/*
+ * name of the track of a client in both processes
+ */
+void name(long c, char *label) {
+	int p;
+
+	for (p = WALL; p <= SIMULATED; p++)
+		event("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+			"\"tid\":%ld,\"args\":{\"name\":\"%s\"}}",
+			p, c + 1, label);
+}
+
+/*
+ * an interval on a track in both processes
+ */
+void slice(long tid, char *label, long wall, long wallend,
+		long simulated, long simulatedend) {
+	event("{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,"
+		"\"ts\":%ld,\"dur\":%ld}",
+		label, WALL, tid, wall, wallend - wall);
+	event("{\"ph\":\"X\",\"name\":\"%s\",\"pid\":%d,\"tid\":%ld,"
+		"\"ts\":%ld,\"dur\":%ld}",
+		label, SIMULATED, tid,
+		simulated * 1000000, (simulatedend - simulated) * 1000000);
+}
+
+/*
+ * an instant on a track in both processes
+ */
+void instant(long tid, char *label, long wall, long simulated) {
+	event("{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,"
+		"\"tid\":%ld,\"ts\":%ld}",
+		label, WALL, tid, wall);
+	event("{\"ph\":\"i\",\"s\":\"t\",\"name\":\"%s\",\"pid\":%d,"
+		"\"tid\":%ld,\"ts\":%ld}",
+		label, SIMULATED, tid, simulated * 1000000);
+}
+
+/*
+ * change the state of a client, ending the previous one
+ */
+void state(long c, int s, long wall, long simulated) {
+	char label[30];
+
+	if (c < 0 || c >= MAXIDS)
+		return;
+
+	if (clients[c].state == ABSENT) {
+		snprintf(label, 30, "client %ld", c);
+		name(c, label);
+	}
+	else if (clients[c].state == s)
+		return;
+	else
+		slice(c + 1, statename[clients[c].state],
+			clients[c].wall, wall, clients[c].simulated, simulated);
+
+	clients[c].state = s;
+	clients[c].wall = wall;
+	clients[c].simulated = simulated;
+}
+
+int main(int argn, char *argv[]) {
+	FILE *in;
+	long wall, simulated, mtype, client, time;
+	long lastwall, jumpwall, jumpfrom;
+	char label[100];
+	int c, p;
+
+	if (argn - 1 > 1 || (argn - 1 == 1 && ! strcmp(argv[1], "-h"))) {
+		printf("usage:\n\ttimeline [trace]\n");
+		exit(argn - 1 == 1 ? EXIT_SUCCESS : EXIT_FAILURE);
+	}
+
+	if (argn - 1 < 1)
+		in = stdin;
+	else {
+		in = fopen(argv[1], "r");
+		if (in == NULL) {
+			perror(argv[1]);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	first = 1;
+	event("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+		"\"args\":{\"name\":\"wall-clock time\"}}", WALL);
+	event("{\"ph\":\"M\",\"name\":\"process_name\",\"pid\":%d,"
+		"\"args\":{\"name\":\"simulated time\"}}", SIMULATED);
+	for (p = WALL; p <= SIMULATED; p++)
+		event("{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,"
+			"\"tid\":0,\"args\":{\"name\":\"timeserver\"}}", p);
+
+	/* a message about time that waits for the run of its domain is in
+	 * the trace when it arrives, as DEFERRED, and when it is processed */
+
+	lastwall = 0;
+	simulated = 0;
+	jumpfrom = -1;
+	jumpwall = 0;
+	while (5 == fscanf(in, "%ld %ld %ld %ld %ld",
+			&wall, &simulated, &mtype, &client, &time)) {
+
+		if (jumpfrom != -1) {
+			slice(0, "jump", jumpwall, wall, jumpfrom, simulated);
+			jumpfrom = -1;
+		}
+
+		if (mtype >= WAKE(0) && mtype < TIME(0)) {
+			state(client, ACTIVE, wall, simulated);
+			lastwall = wall;
+			continue;
+		}
+
+		if (mtype > DEFERRED(NOTRUNNING) &&
+		    mtype < DEFERRED(TOSERVER)) {
+			state(client, BLOCKED, wall, simulated);
+			lastwall = wall;
+			continue;
+		}
+
+		switch (mtype) {
+		case PID:
+			state(client, ACTIVE, wall, simulated);
+			snprintf(label, 100, "client %ld pid %ld", client, time);
+			if (client >= 0 && client < MAXIDS)
+				name(client, label);
+			break;
+
+		case UNREGISTER:
+			if (client >= 0 && client < MAXIDS &&
+			    clients[client].state != ABSENT) {
+				state(client, ABSENT, wall, simulated);
+				instant(client + 1, "unregister", wall, simulated);
+			}
+			break;
+
+		case LAPSED:
+			if (client >= 0 && client < MAXIDS &&
+			    clients[client].state != ABSENT) {
+				state(client, ABSENT, wall, simulated);
+				instant(client + 1, "lapsed", wall, simulated);
+			}
+			break;
+
+		case TIMEOUT:
+			if (time) {
+				slice(0, "idle", lastwall, wall,
+					simulated, simulated);
+				instant(0, "timeout", wall, simulated);
+			}
+			else
+				instant(0, "jump", wall, simulated);
+			jumpfrom = simulated;
+			jumpwall = wall;
+			break;
+
+		case RUN:
+			snprintf(label, 100, "run(%ld)", time);
+			instant(0, label, wall, simulated);
+			break;
+
+		case QUERY:
+		case SLEEP:
+		case SLEEPUNTIL:
+		case SLEEPUNTILMONO:
+		case CANCEL:
+			if (client < 0 || client >= MAXIDS)
+				break;
+			if (ISSLEEP(mtype))
+				state(client, SLEEPS, wall, simulated);
+			else
+				state(client, ACTIVE, wall, simulated);
+			if (mtype == QUERY)
+				instant(client + 1,
+					time == MONOTONIC ?
+						"query(monotonic)" : "query()",
+					wall, simulated);
+			break;
+		}
+
+		lastwall = wall;
+	}
+
+				/* end the intervals still open */
+
+	if (jumpfrom != -1)
+		slice(0, "jump", jumpwall, wall, jumpfrom, simulated);
+	for (c = 0; c < MAXIDS; c++)
+		if (clients[c].state != ABSENT)
+			state(c, ABSENT, wall, simulated);
+
+	printf("\n]}\n");
+	if (in != stdin)
+		fclose(in);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,328 @@
+/*
+ * timeload.c
+ *
+ * generate a load of processes for testing timeserver at scale
+ *
+ * timeexec timeload [-n processes] [-f fanout] [-e] [-l lifetime]
+ *	[-s sleep] [-q queries] [-b percent] [-w busywait] [-k percent]
+ *	[-r seed]
+ *
+ * -n processes	number of processes; default 10
+ * -f fanout	children of each process; default 10
+ * -e		the children execute timeload again instead of just forking
+ * -l lifetime	simulated seconds each process lives; default 100
+ * -s sleep	seconds of each sleep; default 1-10
+ * -q queries	calls to time() before each sleep; default 1
+ * -b percent	probability of busywaiting instead of sleeping; default 0
+ * -w busywait	seconds of each busywait, polling time(); default 1
+ * -k percent	probability of a process being killed by SIGKILL at a random
+ *		point of its life, without unregistering; default 0
+ * -r seed	seed of the random numbers; default from the pid
+ *
+ * the distributions are N for a constant, A-B for uniform between A and B
+ * inclusive, eN for exponential with mean N
+ *
+ * the processes form a tree: process i starts processes i*fanout+1 to
+ * i*fanout+fanout; each reports to the first process through a pipe when it
+ * ends, and the first process prints the totals: processes ended and killed,
+ * sleeps, queries, busywaits, simulated time and wall-clock time, and their
+ * ratio; the first process makes no call about time, so that it does not
+ * register with the timeserver while waiting
+ *
+ * example:
+ *	timeserver -s 64 &
+ *	timeexec timeload -n 10000 -f 20 -l 1000 -s e50 -b 5 -k 1 &
+ *	timerun 100000
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <math.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+/*
+ * distribution of a random number
+ */
+#define CONSTANT 0
+#define UNIFORM 1
+#define EXPONENTIAL 2
+
+struct distribution {
+	int kind;
+	double a, b;
+};
+
+/*
+ * report of a process when it ends, small enough to be written atomically
+ */
+struct report {
+	long start;
+	long end;
+	long sleeps;
+	long queries;
+	long busywaits;
+};
+
+/*
+ * parameters
+ */
+long processes, fanout, execute, killpercent, busypercent, seed;
+struct distribution lifetime, sleeps, queries, busywait;
+int reportfd;
+char **args;
+int numargs;
+
+/*
+ * parse a distribution
+ */
+int distribution(char *arg, struct distribution *d) {
+	if (arg[0] == 'e') {
+		d->kind = EXPONENTIAL;
+		d->a = atof(arg + 1);
+		return d->a > 0 ? 0 : -1;
+	}
+	if (strchr(arg, '-') != NULL) {
+		d->kind = UNIFORM;
+		return sscanf(arg, "%lf-%lf", &d->a, &d->b) == 2 &&
+			d->a <= d->b ? 0 : -1;
+	}
+	d->kind = CONSTANT;
+	return sscanf(arg, "%lf", &d->a) == 1 ? 0 : -1;
+}
+
+/*
+ * draw a number from a distribution
+ */
+long draw(struct distribution *d) {
+	double u;
+
+	switch (d->kind) {
+	case UNIFORM:
+		return d->a + random() % (long) (d->b - d->a + 1);
+	case EXPONENTIAL:
+		u = (random() + 1.0) / (RAND_MAX + 2.0);
+		return -d->a * log(u) + 0.5;
+	default:
+		return d->a;
+	}
+}
+
+/*
+ * wall-clock time in seconds, from the kernel and not from the preload library
+ */
+double walltime() {
+	struct timespec ts;
+
+	syscall(SYS_clock_gettime, CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * start a process of the tree
+ */
+void worker(long id);
+
+void spawn(long id) {
+	char **argv, internal[100];
+	pid_t pid;
+
+	pid = fork();
+	if (pid == -1) {
+		perror("fork");
+		return;
+	}
+	if (pid != 0)
+		return;
+
+	if (! execute)
+		worker(id);
+
+	argv = malloc((numargs + 3) * sizeof(char *));
+	memcpy(argv, args, numargs * sizeof(char *));
+	snprintf(internal, 100, "%ld:%d", id, reportfd);
+	argv[numargs] = "-I";
+	argv[numargs + 1] = internal;
+	argv[numargs + 2] = NULL;
+	execv("/proc/self/exe", argv);
+	perror("execv");
+	_exit(EXIT_FAILURE);
+}
+
+/*
+ * the life of a process of the tree
+ */
+void worker(long id) {
+	struct report r;
+	long c, end, killat, t, n;
+
+	srandom(seed + id);
+
+	/* the children killed are reaped at once, or the timeserver would
+	 * still find their pids */
+	signal(SIGCHLD, SIG_IGN);
+
+	for (c = id * fanout + 1; c <= id * fanout + fanout; c++)
+		if (c < processes)
+			spawn(c);
+
+	memset(&r, 0, sizeof(r));
+	r.start = time(NULL);
+	r.queries++;
+	end = r.start + draw(&lifetime);
+	killat = random() % 100 < killpercent ?
+		r.start + random() % (end - r.start + 1) : -1;
+
+	for (t = r.start; t < end; ) {
+		if (killat != -1 && t >= killat)
+			kill(getpid(), SIGKILL);
+
+		if (random() % 100 < busypercent) {
+			r.busywaits++;
+			for (n = t + draw(&busywait); t < n; r.queries++)
+				t = time(NULL);
+			continue;
+		}
+
+		for (n = draw(&queries); n > 0; n--) {
+			t = time(NULL);
+			r.queries++;
+		}
+		sleep(draw(&sleeps));
+		r.sleeps++;
+		t = time(NULL);
+		r.queries++;
+	}
+
+	r.end = t;
+	write(reportfd, &r, sizeof(r));
+	exit(EXIT_SUCCESS);
+}
+
+void usage() {
+	printf("usage:\n\ttimeload [-n processes] [-f fanout] [-e] ");
+	printf("[-l lifetime]\n\t\t[-s sleep] [-q queries] ");
+	printf("[-b percent] [-w busywait]\n\t\t[-k percent] [-r seed]\n");
+}
+
+int main(int argn, char *argv[]) {
+	int opt, fd[2];
+	long id, ended, start, end;
+	double wallstart, wall;
+	struct report r, total;
+
+				/* arguments */
+
+	processes = 10;
+	fanout = 10;
+	execute = 0;
+	killpercent = 0;
+	busypercent = 0;
+	seed = getpid();
+	distribution("100", &lifetime);
+	distribution("1-10", &sleeps);
+	distribution("1", &queries);
+	distribution("1", &busywait);
+	id = -1;
+
+	while (-1 != (opt = getopt(argn, argv, "n:f:el:s:q:b:w:k:r:I:h")))
+		switch (opt) {
+		case 'n':
+			processes = atol(optarg);
+			break;
+		case 'f':
+			fanout = atol(optarg);
+			break;
+		case 'e':
+			execute = 1;
+			break;
+		case 'l':
+			if (distribution(optarg, &lifetime) == -1)
+				opt = '?';
+			break;
+		case 's':
+			if (distribution(optarg, &sleeps) == -1)
+				opt = '?';
+			break;
+		case 'q':
+			if (distribution(optarg, &queries) == -1)
+				opt = '?';
+			break;
+		case 'b':
+			busypercent = atol(optarg);
+			break;
+		case 'w':
+			if (distribution(optarg, &busywait) == -1)
+				opt = '?';
+			break;
+		case 'k':
+			killpercent = atol(optarg);
+			break;
+		case 'r':
+			seed = atol(optarg);
+			break;
+		case 'I':
+			/* internal: a process of the tree executed by -e */
+			sscanf(optarg, "%ld:%d", &id, &reportfd);
+			break;
+		case 'h':
+			usage();
+			exit(EXIT_SUCCESS);
+		default:
+			usage();
+			exit(EXIT_FAILURE);
+		}
+	if (processes < 1 || fanout < 1) {
+		usage();
+		exit(EXIT_FAILURE);
+	}
+
+	args = argv;
+	numargs = id == -1 ? argn : argn - 2;
+
+	if (id != -1)
+		worker(id);
+
+				/* start the tree, collect the reports */
+
+	if (pipe(fd) == -1) {
+		perror("pipe");
+		exit(EXIT_FAILURE);
+	}
+	reportfd = fd[1];
+
+	wallstart = walltime();
+	spawn(0);
+	close(fd[1]);
+
+	memset(&total, 0, sizeof(total));
+	start = -1;
+	end = -1;
+	for (ended = 0; read(fd[0], &r, sizeof(r)) == sizeof(r); ended++) {
+		if (start == -1 || r.start < start)
+			start = r.start;
+		if (r.end > end)
+			end = r.end;
+		total.sleeps += r.sleeps;
+		total.queries += r.queries;
+		total.busywaits += r.busywaits;
+	}
+	wall = walltime() - wallstart;
+	while (wait(NULL) != -1)
+		;
+
+				/* totals */
+
+	printf("processes: %ld ended, %ld killed\n",
+		ended, processes - ended);
+	printf("sleeps: %ld queries: %ld busywaits: %ld\n",
+		total.sleeps, total.queries, total.busywaits);
+	printf("simulated: %ld s wall: %.3f s ratio: %.1f\n",
+		end - start, wall, wall > 0 ? (end - start) / wall : 0);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,391 @@
+/*
+ * timelocal.c
+ *
+ * run a program on a simulated time kept in the program itself, without
+ * timeserver
+ *
+ * timeexec -l program args
+ *
+ * is the same as:
+ * LD_PRELOAD=./timelocal.so program args
+ * where timelocal.so is from this file
+ *
+ * meant for programs made of a single process with many threads, like unit
+ * tests: the clock and the sleeping threads are in the process, so that no
+ * message is exchanged; the time behaves as in a timeserver run forever:
+ *
+ * - time stands still while the threads run
+ * - each query increases time by one second with probability 1/busywait
+ * - when all threads sleep, time jumps to the first wakeup
+ * - when the threads that do not sleep make no call about time for idletime
+ *   microseconds, time jumps to the first wakeup anyway; they may be waiting
+ *   for a sleeping thread on a mutex, or just computing
+ *
+ * TIMELOCALORIGIN	starting time, in seconds since epoch or "now"; default 0
+ * TIMELOCALIDLE	idletime in microseconds; default 50000
+ * TIMELOCALBUSYWAIT	busywait; default 2, 0 disables the increase
+ *
+ * the threads are counted by intercepting pthread_create(); a forked child
+ * continues on a copy of the clock of its parent, a program executed starts
+ * from the origin again: processes do not share the time; sleeps are not
+ * interrupted by signals
+ */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <dlfcn.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#define MAXSLEEPERS 1000
+
+/*
+ * wakeup times of the sleeping threads, or one of these
+ */
+#define FREE -2
+#define WOKEN -1
+
+/*
+ * the simulation
+ */
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t wakecond;
+long now, origin;
+long idletime;
+int busywait;
+unsigned int seed;
+int numthreads, numsleeping;
+long wakeups[MAXSLEEPERS];
+unsigned long activity;		/* calls about time so far */
+
+/*
+ * original functions
+ */
+unsigned int (* sleep_orig)(unsigned int seconds);
+time_t (* time_orig)(time_t *tloc);
+int (* clock_gettime_orig)(clockid_t clock_id, struct timespec *tp);
+int (* clock_nanosleep_orig)(clockid_t clock_id, int flags,
+	const struct timespec *request, struct timespec *remain);
+int (* pthread_create_orig)(pthread_t *thread, const pthread_attr_t *attr,
+	void *(* start)(void *), void *arg);
+
+/*
+ * wake the threads whose wakeup time has come
+ */
+void wake() {
+	int s, woken;
+
+	woken = 0;
+	for (s = 0; s < MAXSLEEPERS; s++)
+		if (wakeups[s] >= 0 && wakeups[s] <= now) {
+			wakeups[s] = WOKEN;
+			numsleeping--;
+			woken = 1;
+		}
+	if (woken)
+		pthread_cond_broadcast(&wakecond);
+}
+
+/*
+ * jump to the first wakeup time
+ */
+void jump() {
+	int s;
+	long first;
+
+	first = -1;
+	for (s = 0; s < MAXSLEEPERS; s++)
+		if (wakeups[s] >= 0 && (first == -1 || wakeups[s] < first))
+			first = wakeups[s];
+	if (first == -1)
+		return;
+
+	if (first > now)
+		now = first;
+	wake();
+}
+
+/*
+ * current time, increased with probability 1/busywait after being read
+ */
+long querytime() {
+	long t;
+
+	pthread_mutex_lock(&lock);
+	activity++;
+	t = now;
+	if (busywait && rand_r(&seed) % busywait == 0) {
+		now++;
+		wake();
+	}
+	pthread_mutex_unlock(&lock);
+
+	return t;
+}
+
+/*
+ * sleep a number of seconds of simulated time, or until a time if absolute
+ */
+void sleepfor(long seconds, int absolute) {
+	int s, res;
+	unsigned long seen;
+	struct timespec deadline;
+
+	pthread_mutex_lock(&lock);
+	activity++;
+
+	for (s = 0; s < MAXSLEEPERS && wakeups[s] != FREE; s++)
+		;
+	if (s >= MAXSLEEPERS) {
+		if (absolute)
+			seconds -= now;
+		pthread_mutex_unlock(&lock);
+		if (seconds > 0)
+			sleep_orig(seconds);
+		return;
+	}
+
+	wakeups[s] = absolute ? seconds : now + seconds;
+	numsleeping++;
+	wake();
+	if (wakeups[s] != WOKEN && numsleeping >= numthreads)
+		jump();
+
+	/* a timeout with no call about time from the threads that do not
+	 * sleep is a jump, as in timeserver */
+
+	seen = activity;
+	while (wakeups[s] != WOKEN) {
+		clock_gettime_orig(CLOCK_MONOTONIC, &deadline);
+		deadline.tv_nsec += idletime * 1000;
+		deadline.tv_sec += deadline.tv_nsec / 1000000000;
+		deadline.tv_nsec %= 1000000000;
+		res = pthread_cond_timedwait(&wakecond, &lock, &deadline);
+		if (res == ETIMEDOUT && activity == seen)
+			jump();
+		seen = activity;
+	}
+
+	wakeups[s] = FREE;
+	activity++;
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * thread accounting
+ *
+ * a new thread is counted before it exists, so that time does not jump
+ * because the others sleep before it starts
+ */
+
+struct start {
+	void *(* start)(void *);
+	void *arg;
+};
+
+void ended(void *arg) {
+	(void) arg;
+	pthread_mutex_lock(&lock);
+	numthreads--;
+	if (numsleeping > 0 && numsleeping >= numthreads)
+		jump();
+	pthread_mutex_unlock(&lock);
+}
+
+void *started(void *arg) {
+	struct start s;
+	void *res;
+
+	s = *(struct start *) arg;
+	free(arg);
+
+	pthread_cleanup_push(ended, NULL);
+	res = s.start(s.arg);
+	pthread_cleanup_pop(1);
+	return res;
+}
+
+int pthread_create(pthread_t *thread, const pthread_attr_t *attr,
+		void *(* start)(void *), void *arg) {
+	struct start *s;
+	int res;
+
+	s = malloc(sizeof(struct start));
+	if (s == NULL)
+		return EAGAIN;
+	s->start = start;
+	s->arg = arg;
+
+	pthread_mutex_lock(&lock);
+	numthreads++;
+	pthread_mutex_unlock(&lock);
+
+	res = pthread_create_orig(thread, attr, started, s);
+	if (res != 0) {
+		free(s);
+		ended(NULL);
+	}
+	return res;
+}
+
+/*
+ * a forked child has only the thread that called fork()
+ */
+void condinit() {
+	pthread_condattr_t attr;
+
+	pthread_condattr_init(&attr);
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	pthread_cond_init(&wakecond, &attr);
+	pthread_condattr_destroy(&attr);
+}
+
+void forking() {
+	pthread_mutex_lock(&lock);
+}
+
+void forked() {
+	pthread_mutex_unlock(&lock);
+}
+
+void child() {
+	int s;
+
+	pthread_mutex_init(&lock, NULL);
+	condinit();
+	numthreads = 1;
+	numsleeping = 0;
+	for (s = 0; s < MAXSLEEPERS; s++)
+		wakeups[s] = FREE;
+}
+
+/*
+ * new functions for time
+ *
+ * a fraction of second is rounded up, so that a loop of short sleeps advances
+ * the time instead of spinning
+ */
+
+unsigned int sleep(unsigned int seconds) {
+	sleepfor(seconds, 0);
+	return 0;
+}
+
+int usleep(useconds_t usec) {
+	sleepfor((usec + 999999) / 1000000, 0);
+	return 0;
+}
+
+int nanosleep(const struct timespec *req, struct timespec *rem) {
+	(void) rem;
+	sleepfor(req->tv_sec + (req->tv_nsec > 0), 0);
+	return 0;
+}
+
+int clock_nanosleep(clockid_t clock_id, int flags,
+		const struct timespec *request, struct timespec *remain) {
+	long seconds;
+
+	seconds = request->tv_sec + (request->tv_nsec > 0);
+	switch (clock_id) {
+	case CLOCK_REALTIME:
+	case CLOCK_TAI:
+		if (flags & TIMER_ABSTIME)
+			seconds -= origin;
+		break;
+	case CLOCK_MONOTONIC:
+	case CLOCK_BOOTTIME:
+		break;
+	default:
+		return clock_nanosleep_orig(clock_id, flags, request, remain);
+	}
+	sleepfor(seconds, flags & TIMER_ABSTIME);
+	return 0;
+}
+
+time_t time(time_t *tloc) {
+	long t;
+
+	t = origin + querytime();
+	if (tloc)
+		*tloc = t;
+	return t;
+}
+
+/*
+ * the c library declares tp of gettimeofday() nonnull, which would drop the
+ * check for programs that pass NULL anyway
+ */
+int simulated_gettimeofday(struct timeval *restrict tp, void *restrict tzp) {
+	(void) tzp;
+	if (tp) {
+		tp->tv_sec = origin + querytime();
+		tp->tv_usec = 12;
+	}
+	return 0;
+}
+
+int gettimeofday(struct timeval *restrict tp, void *restrict tzp) {
+	return simulated_gettimeofday(tp, tzp);
+}
+
+int clock_gettime(clockid_t clock_id, struct timespec *tp) {
+	switch (clock_id) {
+	case CLOCK_REALTIME:
+	case CLOCK_REALTIME_COARSE:
+	case CLOCK_REALTIME_ALARM:
+	case CLOCK_TAI:
+		tp->tv_sec = origin + querytime();
+		break;
+	case CLOCK_MONOTONIC:
+	case CLOCK_MONOTONIC_RAW:
+	case CLOCK_MONOTONIC_COARSE:
+	case CLOCK_BOOTTIME:
+	case CLOCK_BOOTTIME_ALARM:
+		tp->tv_sec = querytime();
+		break;
+	default:
+		return clock_gettime_orig(clock_id, tp);
+	}
+	tp->tv_nsec = 1234;
+	return 0;
+}
+
+/*
+ * constructor
+ */
+
+static void __attribute__((constructor)) init() {
+	char *env;
+	int s;
+
+	sleep_orig = dlsym(RTLD_NEXT, "sleep");
+	time_orig = dlsym(RTLD_NEXT, "time");
+	clock_gettime_orig = dlsym(RTLD_NEXT, "clock_gettime");
+	clock_nanosleep_orig = dlsym(RTLD_NEXT, "clock_nanosleep");
+	pthread_create_orig = dlsym(RTLD_NEXT, "pthread_create");
+
+	env = getenv("TIMELOCALORIGIN");
+	origin = env == NULL ? 0 :
+		! strcmp(env, "now") ? time_orig(NULL) : atol(env);
+	env = getenv("TIMELOCALIDLE");
+	idletime = env == NULL ? 50000 : atol(env);
+	env = getenv("TIMELOCALBUSYWAIT");
+	busywait = env == NULL ? 2 : atoi(env);
+	seed = time_orig(NULL) + getpid();
+
+	condinit();
+
+	now = 0;
+	numthreads = 1;
+	numsleeping = 0;
+	for (s = 0; s < MAXSLEEPERS; s++)
+		wakeups[s] = FREE;
+
+	pthread_atfork(forking, forked, child);
+}
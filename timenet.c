@@ -0,0 +1,209 @@
+/*
+ * timenet.c
+ *
+ * socket transport for the messages between timeserver and timerelay
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <endian.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#define NOMSG
+#include "timecontrol.h"
+#include "timenet.h"
+
+/*
+ * resolve an address: a unix socket in un, or tcp addresses in ai
+ */
+int net_address(char *address, int passive, struct addrinfo **ai,
+		struct sockaddr_un *un) {
+	char *colon, host[200];
+	struct addrinfo hints;
+	int res;
+
+	colon = strrchr(address, ':');
+	if (colon == NULL) {
+		memset(un, 0, sizeof(struct sockaddr_un));
+		un->sun_family = AF_UNIX;
+		strncpy(un->sun_path, address, sizeof(un->sun_path) - 1);
+		*ai = NULL;
+		return 0;
+	}
+
+	snprintf(host, 200, "%.*s", (int) (colon - address), address);
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	res = getaddrinfo(host[0] == '\0' ? NULL : host, colon + 1,
+		&hints, ai);
+	if (res != 0) {
+		fprintf(stderr, "%s: %s\n", address, gai_strerror(res));
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * listen on an address; the first of its tcp addresses that can be bound,
+ * in the order of getaddrinfo()
+ */
+int net_listen(char *address) {
+	struct addrinfo *ai, *a;
+	struct sockaddr_un un;
+	int fd, one;
+
+	if (net_address(address, 1, &ai, &un) == -1)
+		return -1;
+
+	if (ai == NULL) {
+		unlink(un.sun_path);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd == -1 ||
+		    bind(fd, (struct sockaddr *) &un, sizeof(un)) == -1) {
+			perror(address);
+			return -1;
+		}
+	}
+	else {
+		fd = -1;
+		for (a = ai; a != NULL && fd == -1; a = a->ai_next) {
+			fd = socket(a->ai_family, a->ai_socktype,
+				a->ai_protocol);
+			if (fd == -1)
+				continue;
+			one = 1;
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR,
+				&one, sizeof(one));
+			if (bind(fd, a->ai_addr, a->ai_addrlen) == -1) {
+				close(fd);
+				fd = -1;
+			}
+		}
+		freeaddrinfo(ai);
+		if (fd == -1) {
+			perror(address);
+			return -1;
+		}
+	}
+
+	if (listen(fd, 16) == -1) {
+		perror("listen");
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * connect to an address; its tcp addresses are tried in turn, since a name
+ * may resolve to ::1 first while the timeserver listens on 0.0.0.0
+ */
+int net_connect(char *address) {
+	struct addrinfo *ai, *a;
+	struct sockaddr_un un;
+	int fd, res, one;
+
+	if (net_address(address, 0, &ai, &un) == -1)
+		return -1;
+
+	if (ai == NULL) {
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		res = fd == -1 ? -1 :
+			connect(fd, (struct sockaddr *) &un, sizeof(un));
+	}
+	else {
+		fd = -1;
+		res = -1;
+		for (a = ai; a != NULL && res == -1; a = a->ai_next) {
+			fd = socket(a->ai_family, a->ai_socktype,
+				a->ai_protocol);
+			if (fd == -1)
+				continue;
+			res = connect(fd, a->ai_addr, a->ai_addrlen);
+			if (res == -1)
+				close(fd);
+		}
+		if (res != -1) {
+			one = 1;
+			setsockopt(fd, IPPROTO_TCP, TCP_NODELAY,
+				&one, sizeof(one));
+		}
+		freeaddrinfo(ai);
+	}
+
+	if (res == -1) {
+		perror(address);
+		return -1;
+	}
+	return fd;
+}
+
+/*
+ * send some messages in a single write
+ */
+int net_send(int fd, struct timemsg *m, int n) {
+	unsigned char buf[NETBUFSIZE];
+	uint64_t v[3];
+	int i, len, res;
+
+	for (i = 0; i < n && (i + 1) * NETMSGSIZE <= NETBUFSIZE; i++) {
+		v[0] = htobe64(m[i].mtype);
+		v[1] = htobe64(m[i].client);
+		v[2] = htobe64(m[i].time);
+		memcpy(buf + i * NETMSGSIZE, v, NETMSGSIZE);
+	}
+
+	for (len = 0; len < i * NETMSGSIZE; len += res) {
+		res = write(fd, buf + len, i * NETMSGSIZE - len);
+		if (res == -1 && errno == EINTR)
+			res = 0;
+		else if (res == -1)
+			return -1;
+	}
+	return i;
+}
+
+/*
+ * receive a message; return 0 at end of file, -1 on error or with errno EINTR
+ * when a signal interrupts the read, for the caller to check its flags
+ */
+int net_recv(int fd, struct netbuf *b, struct timemsg *m) {
+	uint64_t v[3];
+	int res;
+
+	if (b->end - b->start < NETMSGSIZE) {
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+
+	while (b->end - b->start < NETMSGSIZE) {
+		res = read(fd, b->data + b->end, NETBUFSIZE - b->end);
+		if (res <= 0)
+			return res;
+		b->end += res;
+	}
+
+	memcpy(v, b->data + b->start, NETMSGSIZE);
+	b->start += NETMSGSIZE;
+	m->mtype = be64toh(v[0]);
+	m->client = be64toh(v[1]);
+	m->time = be64toh(v[2]);
+	return 1;
+}
+
+/*
+ * whether a message is already in the buffer
+ */
+int net_pending(struct netbuf *b) {
+	return b->end - b->start >= NETMSGSIZE;
+}
@@ -0,0 +1,23 @@
+/*
+ * timenet.h
+ *
+ * messages of timecontrol.h over a stream socket, for simulations spanning
+ * multiple hosts; each message is three 64-bit integers in network byte order
+ *
+ * the address is host:port for tcp, with an empty host meaning all addresses
+ * when listening; otherwise it is the path of a unix-domain socket
+ */
+
+#define NETMSGSIZE 24
+#define NETBUFSIZE (256 * NETMSGSIZE)
+
+struct netbuf {
+	unsigned char data[NETBUFSIZE];
+	int start, end;
+};
+
+int net_listen(char *address);
+int net_connect(char *address);
+int net_send(int fd, struct timemsg *m, int n);
+int net_recv(int fd, struct netbuf *b, struct timemsg *m);
+int net_pending(struct netbuf *b);
@@ -0,0 +1,73 @@
+/*
+ * timeplugin.h
+ *
+ * interface of the plugins of the timeserver
+ *
+ * timeserver -P plugin.so[:argument]
+ *
+ * a plugin is a shared object defining some of the functions below; they are
+ * found by dlsym(), and the server behaves as usual for those missing; all
+ * are called with the lock of the server held, so that a plugin needs no
+ * lock of its own even with -s, but should return quickly
+ *
+ * a plugin steers the simulation by changing *now and *end from any of
+ * them; the time never goes back: a smaller now is ignored; the clients whose
+ * wakeup time is passed are woken after each call
+ *
+ * with timeserver -d, now, end, origin, numclients and numsleeping are those
+ * of the domain of each call; clients and pids include all domains
+ */
+
+#define TIMEPLUGIN_VERSION 1
+
+struct timeplugin {
+	int version;		/* TIMEPLUGIN_VERSION of the server */
+	long *now;		/* current time, from 0 */
+	long *end;		/* end of the run, or NEXTSLEEP or NEXTWAKE */
+	long origin;		/* seconds added to now for the clients */
+	long *clients;		/* EMPTY, RUNNING or SLEEPING + wakeup - 1 */
+	long *pids;		/* pid of each client, 0 if unknown */
+	long size;		/* number of entries in clients and pids */
+	int *numclients;
+	int *numsleeping;
+	void *data;		/* free for the plugin */
+	long domain;		/* clock domain of the call, see -d */
+	long *domains;		/* domain of each client */
+};
+
+/*
+ * called once at startup with the argument after the colon, NULL if none;
+ * returns TIMEPLUGIN_VERSION, or -1 to stop the server
+ */
+int timeplugin_init(struct timeplugin *p, char *arg);
+
+/*
+ * every message processed, except QUERY: mtype and client as received, time
+ * as in the message; a TIMEOUT has time 1 for a real timeout, 0 for a jump
+ * because all clients sleep
+ */
+void timeplugin_event(struct timeplugin *p, long mtype, long client,
+	long time);
+
+/*
+ * a QUERY from a client; advance is the number of seconds the server would
+ * add to the time, 0 or 1 depending on -b; returns the seconds to add
+ */
+long timeplugin_query(struct timeplugin *p, long client, long advance);
+
+/*
+ * a timeout or a jump; next is the time the server would jump to, given -j,
+ * the next wakeup and the end of the run; returns the new time
+ */
+long timeplugin_jump(struct timeplugin *p, long next, int timeout);
+
+/*
+ * the clients to be woken now, in order of id; the plugin may reorder them
+ * to choose which is woken first
+ */
+void timeplugin_order(struct timeplugin *p, long *clients, int n);
+
+/*
+ * called when the server ends
+ */
+void timeplugin_fini(struct timeplugin *p);
@@ -0,0 +1,220 @@
+/*
+ * timerelay.c
+ *
+ * bridge the clients on this host to a timeserver on another host
+ *
+ * timerelay address
+ *
+ * the relay takes the place of the timeserver on this host: it creates the
+ * message queue, forwards the messages of the clients to the timeserver
+ * through a socket and its replies back to the queue; the address is
+ * host:port for tcp, otherwise the path of a unix socket; the timeserver is
+ * started with -l and the same address
+ *
+ * example:
+ *
+ * host1: timeserver -l :4000
+ * host2: timerelay host1:4000
+ * host2: timeexec program args
+ * host1: timerun 100
+ *
+ * on a single machine, a different keyfile separates the queue of the relay
+ * from that of the timeserver:
+ *
+ * timeserver -l /tmp/timeserver.socket
+ * touch /tmp/relay
+ * TIMESERVERFILE=/tmp/relay timerelay /tmp/timeserver.socket
+ * TIMESERVERFILE=/tmp/relay timeexec program args
+ * timerun 100
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/msg.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "timecontrol.h"
+#include "timenet.h"
+
+/*
+ * messages read from the queue at once and sent in a single write
+ */
+#define BATCH 64
+
+int queue, sock;
+pthread_mutex_t sending = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * the clients of this host all are in the same shard of the timeserver;
+ * their pids are checked here, since the timeserver cannot
+ */
+long pids[MAXCLIENTS];
+long ids[MAXCLIENTS];
+
+void send_server(struct timemsg *m, int n) {
+	pthread_mutex_lock(&sending);
+	if (net_send(sock, m, n) == -1)
+		perror("send");
+	pthread_mutex_unlock(&sending);
+}
+
+/*
+ * forward the messages of the clients to the timeserver
+ */
+void *toserver(void *arg) {
+	struct timemsg batch[BATCH];
+	int n, i;
+	long c;
+
+	(void) arg;
+
+	while (1) {
+		if (msgrcv(queue, &batch[0], msgsize, -TOSERVER, 0) == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		for (n = 1; n < BATCH; n++)
+			if (msgrcv(queue, &batch[n], msgsize, -TOSERVER,
+			           IPC_NOWAIT) == -1)
+				break;
+
+		for (i = 0; i < n; i++) {
+			c = batch[i].client % MAXCLIENTS;
+			if (c < 0)
+				continue;
+			if (batch[i].mtype == PID) {
+				ids[c] = batch[i].client;
+				pids[c] = batch[i].time;
+			}
+			else if (batch[i].mtype == UNREGISTER)
+				pids[c] = 0;
+		}
+
+		send_server(batch, n);
+	}
+
+	return NULL;
+}
+
+/*
+ * unregister the clients killed by signals
+ */
+void *checker(void *arg) {
+	struct timemsg m;
+	int c;
+
+	(void) arg;
+
+	while (1) {
+		sleep(1);
+		for (c = 0; c < MAXCLIENTS; c++) {
+			if (pids[c] == 0)
+				continue;
+			if (kill(pids[c], 0) == 0 || errno != ESRCH)
+				continue;
+
+			pids[c] = 0;
+			while (-1 != msgrcv(queue, &m, msgsize, WAKE(ids[c]),
+			                    IPC_NOWAIT))
+				;
+			m.mtype = UNREGISTER;
+			m.client = ids[c];
+			m.time = 0;
+			send_server(&m, 1);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * termination
+ */
+int terminated;
+void handler(int s) {
+	(void) s;
+	terminated = 1;
+}
+
+/*
+ * main
+ */
+int main(int argn, char *argv[]) {
+	key_t key;
+	struct netbuf in;
+	struct timemsg m;
+	struct sigaction sa;
+	sigset_t blocked;
+	pthread_t forward, check;
+	int res;
+
+	if (argn - 1 < 1 || ! strcmp(argv[1], "-h")) {
+		printf("usage:\n\ttimerelay host:port|path\n");
+		exit(argn - 1 < 1 ? EXIT_FAILURE : EXIT_SUCCESS);
+	}
+
+				/* connect to the timeserver */
+
+	sock = net_connect(argv[1]);
+	if (sock == -1)
+		exit(EXIT_FAILURE);
+
+				/* create the message queue */
+
+	key = ftok(KEYFILE, TIMESERVER);
+	if (key == -1) {
+		perror(KEYFILE);
+		exit(EXIT_FAILURE);
+	}
+
+	queue = msgget(key, IPC_CREAT | 0700);
+	if (queue == -1) {
+		perror("msgget");
+		exit(EXIT_FAILURE);
+	}
+
+				/* signal handlers, interrupting read() */
+
+	sa.sa_handler = handler;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_flags = 0;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+
+				/* forward messages, the signals to this thread */
+
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+	pthread_create(&forward, NULL, toserver, NULL);
+	pthread_create(&check, NULL, checker, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
+
+	in.start = 0;
+	in.end = 0;
+	while (! terminated) {
+		res = net_recv(sock, &in, &m);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res != 1)
+			break;
+		if (msgsnd(queue, &m, msgsize, 0) == -1)
+			perror("msgsnd");
+	}
+
+				/* remove queue */
+
+	if (msgctl(queue, IPC_RMID, NULL) == -1) {
+		perror("msgctl");
+		exit(EXIT_FAILURE);
+	}
+	close(sock);
+
+	return 0;
+}
@@ -12,6 +12,7 @@
  * timerun			# run until next sleep or unregister
  * timerun 100			# other 100 seconds of simulation
  * timerun wake			# run until next wakeup
+ * timerun -d 1 10		# run 10 seconds of clock domain 1
  */
 
 #include <stdlib.h>
@@ -32,20 +33,30 @@ int main(int argn, char *argv[]) {
 	int queue;
 	key_t key;
 	int seconds;
-	int res;
+	int res, opt;
+	long domain;
 
-				/* argument */
+				/* arguments */
 
-	if (argn - 1 < 1 || ! strcmp(argv[1], "sleep"))
+	domain = 0;
+	while (-1 != (opt = getopt(argn, argv, "d:h")))
+		switch (opt) {
+		case 'd':
+			domain = atol(optarg);
+			break;
+		case 'h':
+		default:
+			printf("usage:\n\ttimerun [-d domain] "
+				"[seconds|\"sleep\"|\"wake\"|-h]\n");
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+	if (argn - optind < 1 || ! strcmp(argv[optind], "sleep"))
 		seconds = NEXTSLEEP;
-	else if (! strcmp(argv[1], "wake"))
+	else if (! strcmp(argv[optind], "wake"))
 		seconds = NEXTWAKE;
-	else if (! strcmp(argv[1], "-h")) {
-		printf("usage:\n\ttimeexec [seconds|\"sleep\"|\"wake\"|-h]\n");
-		exit(EXIT_SUCCESS);
-	}
 	else
-		seconds = atoi(argv[1]);
+		seconds = atoi(argv[optind]);
 
 				/* open queue */
 
@@ -64,6 +75,7 @@ int main(int argn, char *argv[]) {
 				/* run simulation */
 
 	msg.mtype = RUN;
+	msg.client = domain;
 	msg.time = seconds;
 	res = msgsnd(queue, &msg, msgsize, 0);
 	if (res == -1) {
@@ -7,7 +7,8 @@
  *
  * -t origin
  *	starting time of the simulation in seconds since epoch, or "now";
- *	default is 0
+ *	default is 0; with -d, a list separated by commas gives the origin of
+ *	each domain, the last one repeated for the domains after it
  *
  * -i microseconds
  *	after this number of microseconds of client inactivity, jump to the
@@ -28,6 +29,57 @@
  *	not been reached, jump to the next wakeup time; this speeds up
  *	simulation, but does not work in general (see README)
  *
+ * -r file
+ *	record the sequence of decisions of the server in a trace file
+ *
+ * -p file
+ *	replay a trace recorded by -r: messages from the clients are processed
+ *	in the same order as in the recorded run, timeouts and runs are taken
+ *	from the trace without waiting; when the trace ends the simulation
+ *	continues as usual; requires the same options of the recorded run
+ *
+ * -s shards
+ *	distribute the clients among this number of message queues, each
+ *	served by its own thread; default is 1
+ *
+ * -k factor
+ *	while some clients are not sleeping, time flows at this factor of the
+ *	real time; when all are sleeping, jump to the next wakeup time as
+ *	usual; default is 0, time stands still while clients run
+ *
+ * -l address
+ *	accept connections from timerelay on other hosts at this address,
+ *	host:port for tcp or the path of a unix socket
+ *
+ * -a
+ *	tell idle clients from the state of their processes in /proc: when
+ *	none of them and of their children is running and none used cpu time
+ *	since the last check, jump without waiting for the timeout; the check
+ *	is repeated at increasing intervals while they are busy, up to -i
+ *
+ * -c cgroup
+ *	the clients are run by timeexec -c in this cgroup v2 directory, which
+ *	is created if missing; it is frozen while the simulation is not
+ *	running, and thawed at the next run; idleness is checked as with -a,
+ *	but on all threads of the cgroup, registered or not
+ *
+ * -P plugin.so[:argument]
+ *	load a plugin that may change the time at each message, the advance at
+ *	each query, the jump at each timeout and the order of the wakeups (see
+ *	timeplugin.h)
+ *
+ * -q bytes
+ *	size of the message queues; by default, they are only enlarged to
+ *	four messages per client if smaller
+ *
+ * -d domains
+ *	number of independent clock domains, each with its own time, runs and
+ *	clients; a client chooses its domain with timeexec -d, and timerun -d
+ *	runs a domain; default is 1
+ *
+ * the time lost waiting idle clients before a timeout is attributed to the
+ * clients that were running; the worst are printed at the end and on SIGUSR1
+ *
  * example:
  *
  * timeserver
@@ -37,150 +89,1939 @@
  * timerun 20			# run 20 seconds of simulation
  * timerun			# run until next wakeup time
  * timerun 30			# run 30 seconds of simulation
+ *
+ * timeserver -d 2
+ * timeexec -d 1 program4 args
+ * timerun -d 1 50		# run 50 seconds in domain 1 only
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <sys/msg.h>
+#include <sys/shm.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <limits.h>
+#include <linux/futex.h>
+
+#include "timecontrol.h"
+#include "timenet.h"
+#include "timeplugin.h"
+
+#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+
+/*
+ * interrupts are used only to stop msgrcv
+ */
+int timeout;
+int terminated;
+int reporting;
+void handler(int s) {
+	// printf("signal: %d\n", s);
+
+	if (s == SIGALRM && ! terminated)
+		timeout = 1;
+	else if (s == SIGUSR1)
+		reporting = 1;
+	else
+		terminated = 1;
+}
+
+/*
+ * set the timer for the idle time, or cancel it if usec is 0
+ */
+void settimer(long usec) {
+	struct itimerval timer;
+
+	timer.it_interval.tv_sec = 0;
+	timer.it_interval.tv_usec = 0;
+	timer.it_value.tv_sec = usec / 1000000;
+	timer.it_value.tv_usec = usec % 1000000;
+	setitimer(ITIMER_REAL, &timer, NULL);
+}
+
+/*
+ * microseconds of wall-clock time
+ */
+long wallclock() {
+	struct timeval tv;
+
+	gettimeofday(&tv, NULL);
+	return tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+/*
+ * simulation state
+ *
+ * with -d, each clock domain is a simulation of its own: time, end of the
+ * run, origin and clients; the idle wait of a domain starts from the last
+ * message about it, so that the main thread waits with a single timer for the
+ * first domain to be idle
+ */
+struct domain {
+	long origin, now, end;
+	int numclients, numsleeping;
+	long active;		/* wallclock() of the last message */
+	struct timeval flowed;	/* scaled real time, see flow() */
+	double fraction;
+} domains[MAXDOMAINS];
+int numdomains, dates;
+long *clientdomain;
+long idletime;
+int idlejump, busywait, nofork, idleness;
+double scale;
+
+#define ALLDOMAINS -1
+
+struct domain *domainof(long client) {
+	return &domains[clientdomain[client]];
+}
+
+/*
+ * shards
+ *
+ * with -s, the clients are distributed among shards, each with its own
+ * message queue, its own part of the database of clients and its own thread;
+ * shard 0 is the main queue, read by the main thread, which also receives
+ * registrations and runs and handles timeouts; the id of a client tells its
+ * shard (see SHARD() in timecontrol.h)
+ *
+ * the state is protected by lock; each thread formats its log into its own
+ * buffer and writes it as a whole; the main thread knows that the clients were
+ * not idle from the last message of their domain, even if it did not receive
+ * anything from its own queue; the messages about time of a domain that is not
+ * running are left to the main thread, which processes them at the next run
+ *
+ * with -l, each connection from a timerelay is a shard after the local ones,
+ * whose messages come from and go to a socket instead of a queue; MAXSHARDS
+ * counts both (see timecontrol.h)
+ */
+#define MAXBATCH 32
+struct shard {
+	int queue;
+	int sock;
+	pthread_mutex_t sending;
+	struct netbuf in;
+	pthread_t thread;
+	unsigned int seed;
+	FILE *log;
+	char *buf;
+	size_t len;
+	struct timemsg batch[MAXBATCH];
+	int batched, next;
+	struct timemsg *overflow;
+	int overflowed, overflowsize;
+	long qbytes, sent, full, overflows;
+	long highmessages, highbytes, highoverflow;
+} shards[MAXSHARDS];
+int numshards, lastshard;
+pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t runcond = PTHREAD_COND_INITIALIZER;
+
+int running(struct domain *d) {
+	return d->now < d->end || d->end < 0;
+}
+
+/*
+ * write the log of a shard to stdout
+ */
+void shard_flush(struct shard *sh) {
+	fflush(sh->log);
+	fwrite(sh->buf, 1, sh->len, stdout);
+	fflush(stdout);
+	fseek(sh->log, 0, SEEK_SET);
+}
+
+/*
+ * queue capacity
+ *
+ * the queues are sized at startup to at least MINQBYTES, or to -q; a message
+ * that does not fit in the queue of a shard goes to its overflow list instead
+ * of blocking the thread sending it, which would hold up all other clients;
+ * while the list is not empty, the following messages of the shard go to it
+ * too, so that their order is kept; the lists are retried every RETRYWAIT
+ * microseconds by a thread of their own
+ *
+ * the high-water marks of the queues are sampled every SAMPLESENDS messages
+ * and when a queue is full, and printed with the stalls
+ */
+#define MINQBYTES ((long) (4 * MAXCLIENTS * msgsize))
+#define RETRYWAIT 1000
+#define SAMPLESENDS 64
+long qbytes;
+long overflowing;
+pthread_mutex_t retrylock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t retrycond = PTHREAD_COND_INITIALIZER;
+
+int shard_size(struct shard *sh) {
+	struct msqid_ds ds;
+
+	if (msgctl(sh->queue, IPC_STAT, &ds) == -1) {
+		perror("msgctl");
+		return -1;
+	}
+	sh->qbytes = ds.msg_qbytes;
+	if (qbytes == 0 && (long) ds.msg_qbytes >= MINQBYTES)
+		return 0;
+
+	ds.msg_qbytes = qbytes != 0 ? qbytes : MINQBYTES;
+	if (msgctl(sh->queue, IPC_SET, &ds) == -1) {
+		fprintf(stderr, "queue size %ld: %s; the limit is "
+			"/proc/sys/kernel/msgmnb\n",
+			(long) ds.msg_qbytes, strerror(errno));
+		return -1;
+	}
+	sh->qbytes = ds.msg_qbytes;
+	return 0;
+}
+
+void shard_sample(struct shard *sh) {
+	struct msqid_ds ds;
+
+	if (msgctl(sh->queue, IPC_STAT, &ds) == -1)
+		return;
+	if ((long) ds.msg_qnum > sh->highmessages)
+		sh->highmessages = ds.msg_qnum;
+	if ((long) ds.msg_cbytes > sh->highbytes)
+		sh->highbytes = ds.msg_cbytes;
+}
+
+void overflow_count(long n) {
+	pthread_mutex_lock(&retrylock);
+	overflowing += n;
+	if (n > 0)
+		pthread_cond_signal(&retrycond);
+	pthread_mutex_unlock(&retrylock);
+}
+
+/*
+ * send a message to a queue, or append it to the overflow list; called with
+ * the sending lock of the shard
+ */
+int queue_send(struct shard *sh, struct timemsg *m) {
+	struct timemsg *o;
+	int size;
+
+	if (++sh->sent % SAMPLESENDS == 0)
+		shard_sample(sh);
+
+	if (sh->overflowed == 0) {
+		if (msgsnd(sh->queue, m, msgsize, IPC_NOWAIT) == 0)
+			return 0;
+		if (errno != EAGAIN)
+			return -1;
+		sh->full++;
+		shard_sample(sh);
+	}
+
+	if (sh->overflowed >= sh->overflowsize) {
+		size = sh->overflowsize == 0 ? MAXCLIENTS :
+			sh->overflowsize * 2;
+		o = realloc(sh->overflow, size * sizeof(struct timemsg));
+		if (o == NULL)
+			return -1;
+		sh->overflow = o;
+		sh->overflowsize = size;
+	}
+	sh->overflow[sh->overflowed++] = *m;
+	sh->overflows++;
+	if (sh->overflowed > sh->highoverflow)
+		sh->highoverflow = sh->overflowed;
+	overflow_count(1);
+	return 0;
+}
+
+/*
+ * send the messages of the overflow list that now fit in the queue
+ */
+void queue_retry(struct shard *sh) {
+	int sent;
+
+	pthread_mutex_lock(&sh->sending);
+	for (sent = 0; sent < sh->overflowed; sent++)
+		if (msgsnd(sh->queue, &sh->overflow[sent], msgsize,
+		           IPC_NOWAIT) == -1) {
+			if (errno == EAGAIN)
+				break;
+			perror("msgsnd");
+		}
+	if (sent > 0) {
+		memmove(sh->overflow, sh->overflow + sent,
+			(sh->overflowed - sent) * sizeof(struct timemsg));
+		sh->overflowed -= sent;
+		overflow_count(-sent);
+	}
+	pthread_mutex_unlock(&sh->sending);
+}
+
+void *retry_loop(void *arg) {
+	int s;
+
+	(void) arg;
+
+	while (! terminated) {
+		pthread_mutex_lock(&retrylock);
+		while (overflowing == 0 && ! terminated)
+			pthread_cond_wait(&retrycond, &retrylock);
+		pthread_mutex_unlock(&retrylock);
+
+		usleep(RETRYWAIT);
+		for (s = 0; s < numshards; s++)
+			queue_retry(&shards[s]);
+	}
+
+	return NULL;
+}
+
+void queues_report(FILE *out) {
+	int s;
+	struct shard *sh;
+
+	fprintf(out, "queues: %-8s %-9s %-9s %-9s %-9s %-9s %s\n",
+		"shard", "messages", "bytes", "qbytes", "full",
+		"overflow", "backlog");
+	for (s = 0; s < numshards; s++) {
+		sh = &shards[s];
+		pthread_mutex_lock(&sh->sending);
+		fprintf(out, "        %-8d %-9ld %-9ld %-9ld %-9ld %-9ld %ld\n",
+			s, sh->highmessages, sh->highbytes, sh->qbytes,
+			sh->full, sh->overflows, sh->highoverflow);
+		pthread_mutex_unlock(&sh->sending);
+	}
+	fflush(out);
+}
+
+/*
+ * send a message to a shard
  */
+void shard_send(struct shard *sh, struct timemsg *m) {
+	int res;
+
+	if (sh->sock == -1) {
+		pthread_mutex_lock(&sh->sending);
+		res = queue_send(sh, m);
+		pthread_mutex_unlock(&sh->sending);
+	}
+	else {
+		pthread_mutex_lock(&sh->sending);
+		res = net_send(sh->sock, m, 1);
+		pthread_mutex_unlock(&sh->sending);
+	}
+	if (res == -1)
+		perror(sh->sock == -1 ? "msgsnd" : "send");
+}
+
+/*
+ * send a message to a client, in the queue of its shard
+ */
+void reply(long client, long mtype, long time) {
+	struct timemsg m;
+
+	m.mtype = mtype;
+	m.client = client;
+	m.time = time;
+	shard_send(&shards[SHARD(client)], &m);
+}
+
+/*
+ * wake a client, telling it the seconds left of its sleep
+ */
+void reply_wake(long client, long left) {
+	struct timemsg m;
+	struct domain *d;
+
+	d = domainof(client);
+	m.mtype = WAKE(client);
+	m.client = left;
+	m.time = d->origin + d->now;
+	shard_send(&shards[SHARD(client)], &m);
+}
+
+/*
+ * fair dispatch
+ *
+ * msgrcv() with a negative type returns the lowest type first: QUERY before
+ * the sleeps and CANCEL, so that a few clients busywaiting could delay the
+ * sleeps of the others indefinitely; instead, the messages are drained in
+ * batches, taking one of each class in turn, and each class in order of
+ * arrival; since a client has a single message about time pending, the
+ * clients are served round-robin within each class, and a message waits at
+ * most a batch; when the simulation is not running, only the control
+ * messages are taken
+ */
+long classes[] = {
+	-NOTRUNNING, QUERY, SLEEP, CANCEL, SLEEPUNTIL, SLEEPUNTILMONO
+};
+#define NUMCLASSES ((int) (sizeof(classes) / sizeof(classes[0])))
+
+int shard_fetch(struct shard *sh, struct timemsg *m, int running) {
+	int c, numclasses, left, empty[NUMCLASSES];
+
+	if (sh->next >= sh->batched) {
+		sh->next = 0;
+		sh->batched = 0;
+		numclasses = running ? NUMCLASSES : 1;
+		for (c = 0; c < numclasses; c++)
+			empty[c] = 0;
+		for (left = numclasses; left > 0 && sh->batched < MAXBATCH; )
+			for (c = 0; c < numclasses &&
+			            sh->batched < MAXBATCH; c++) {
+				if (empty[c])
+					continue;
+				if (msgrcv(sh->queue, &sh->batch[sh->batched],
+				           msgsize, classes[c], IPC_NOWAIT) == -1) {
+					empty[c] = 1;
+					left--;
+				}
+				else
+					sh->batched++;
+			}
+	}
+
+	if (sh->next >= sh->batched)
+		return -1;
+	*m = sh->batch[sh->next++];
+	return 0;
+}
+
+/*
+ * cgroup of the clients
+ *
+ * with -c, the clients are in a cgroup v2 directory; freezing it stops also
+ * the clients that make no call about time, which otherwise keep running
+ * between the runs; the cgroup is idle when it has no process, or when none
+ * of its threads is running or waiting for the disk and they used no cpu time
+ * since the previous check; unlike -a, this includes the processes that never
+ * registered, and takes a single directory to read
+ */
+char *cgroup;
+int frozen;
+long cgroupcpu;
+
+int cgroup_init() {
+	if (mkdir(cgroup, 0755) == -1 && errno != EEXIST) {
+		perror(cgroup);
+		return -1;
+	}
+	frozen = -1;
+	cgroupcpu = -1;
+	return 0;
+}
+
+void cgroup_freeze(int freeze) {
+	char path[1000];
+	FILE *f;
+
+	if (cgroup == NULL || freeze == frozen)
+		return;
+
+	snprintf(path, 1000, "%s/cgroup.freeze", cgroup);
+	f = fopen(path, "w");
+	if (f == NULL) {
+		perror(path);
+		return;
+	}
+	fprintf(f, "%d\n", freeze);
+	fclose(f);
+	frozen = freeze;
+}
+
+int cgroup_idle() {
+	FILE *f, *t;
+	char path[1000], line[1000], *p;
+	long usage, tid;
+	int idle;
+
+	snprintf(path, 1000, "%s/cgroup.events", cgroup);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	idle = 0;
+	while (fgets(line, 1000, f) != NULL)
+		if (! strcmp(line, "populated 0\n"))
+			idle = 1;
+	fclose(f);
+	if (idle)
+		return 1;
+
+	snprintf(path, 1000, "%s/cpu.stat", cgroup);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	usage = -1;
+	while (fgets(line, 1000, f) != NULL)
+		sscanf(line, "usage_usec %ld", &usage);
+	fclose(f);
+	idle = usage == cgroupcpu;
+	cgroupcpu = usage;
+	if (! idle)
+		return 0;
+
+	snprintf(path, 1000, "%s/cgroup.threads", cgroup);
+	f = fopen(path, "r");
+	if (f == NULL)
+		return 0;
+	while (idle && fscanf(f, "%ld", &tid) == 1) {
+		snprintf(path, 1000, "/proc/%ld/stat", tid);
+		t = fopen(path, "r");
+		if (t == NULL)
+			continue;
+		p = fgets(line, 1000, t) == NULL ? NULL : strrchr(line, ')');
+		fclose(t);
+		if (p != NULL && (p[2] == 'R' || p[2] == 'D'))
+			idle = 0;
+	}
+	fclose(f);
+	return idle;
+}
+
+/*
+ * database of clients
+ *
+ * the arrays of the clients, their pids, their number of messages and of
+ * wakeups and their domains are in the shared memory segment of the state
+ * (see timecontrol.h), so that timetop reads them with no cost for the server;
+ * the time of the domains is copied there by state_update()
+ */
+
+#define ALLCLIENTS (lastshard * MAXCLIENTS)
+long *clients;
+long *pids;
+long *messages;
+long *wakeups;
+char broadcast[MAXSHARDS * MAXCLIENTS];
+long cputime[MAXSHARDS * MAXCLIENTS];
+
+/*
+ * a client that executes another program keeps its id until the new program
+ * attaches, but only for a lease of idletime, since the program may not load
+ * timeclient.so (static, setuid); then the id is taken back, but not reused
+ * until the process ends, in case the program attaches late
+ */
+#define LAPSEDLEASE -1
+long leases[MAXSHARDS * MAXCLIENTS];
+int numleases;
+
+struct timestate *state;
+int stateid;
+
+void state_init() {
+	key_t key;
+	size_t size;
+
+	size = STATESIZE(MAXSHARDS * MAXCLIENTS);
+	key = ftok(KEYFILE, TIMESERVER);
+	stateid = key == -1 ? -1 : shmget(key, size, IPC_CREAT | 0644);
+	if (stateid == -1 && errno == EINVAL) {
+		/* left by a timeserver with a different size */
+		shmctl(shmget(key, 0, 0), IPC_RMID, NULL);
+		stateid = shmget(key, size, IPC_CREAT | 0644);
+	}
+	state = stateid == -1 ? (void *) -1 : shmat(stateid, NULL, 0);
+	if (state == (void *) -1) {
+		perror("shared memory");
+		stateid = -1;
+		state = malloc(size);
+	}
+
+	memset(state, 0, size);
+	state->size = MAXSHARDS * MAXCLIENTS;
+	clients = STATECLIENTS(state);
+	pids = STATEPIDS(state);
+	messages = STATEMESSAGES(state);
+	wakeups = STATEWAKEUPS(state);
+	clientdomain = STATEDOMAINS(state);
+}
+
+void state_update() {
+	struct timedomain *s;
+	int i, run;
+
+	run = 0;
+	for (i = 0; i < numdomains; i++) {
+		s = &state->domains[i];
+		s->now = domains[i].now;
+		s->end = domains[i].end;
+		s->origin = domains[i].origin;
+		s->numclients = domains[i].numclients;
+		s->numsleeping = domains[i].numsleeping;
+		run |= running(&domains[i]);
+	}
+	state->numdomains = numdomains;
+	cgroup_freeze(! run);
+}
+
+void clients_init() {
+	int c;
+	for (c = 0; c < MAXSHARDS * MAXCLIENTS; c++)
+		clients[c] = EMPTY;
+	for (c = 0; c < numdomains; c++) {
+		domains[c].numclients = 0;
+		domains[c].numsleeping = 0;
+	}
+}
+
+/*
+ * register a client, in the given shard if possible, otherwise in the first
+ * of the others local shards that has space
+ */
+int clients_register(int shard, int others) {
+	int s, c, first;
+	for (s = 0; s < (others ? numshards : 1); s++) {
+		first = (others ? (shard + s) % numshards : shard) * MAXCLIENTS;
+		for (c = first; c < first + MAXCLIENTS; c++)
+			if (clients[c] == EMPTY && leases[c] != LAPSEDLEASE) {
+				clients[c] = RUNNING;
+				pids[c] = 0;
+				messages[c] = 0;
+				broadcast[c] = 0;
+				clientdomain[c] = 0;
+				cputime[c] = -1;
+				return c;
+			}
+	}
+	return -1;
+}
+
+void clients_lease(long c, long until) {
+	numleases += (until > 0) - (leases[c] > 0);
+	leases[c] = until;
+}
+
+void clients_unregister(int c) {
+	if (c >= 0 && c < ALLCLIENTS) {
+		clients[c] = EMPTY;
+		clients_lease(c, 0);
+	}
+}
+
+/*
+ * client of the first lease to end, -1 if none
+ */
+long clients_leased() {
+	long c, min;
+
+	min = -1;
+
+	for (c = 0; c < ALLCLIENTS && numleases > 0; c++)
+		if (leases[c] > 0 && (min == -1 || leases[c] < leases[min]))
+			min = c;
+
+	return min;
+}
+
+/*
+ * remove clients that no longer exists (clients killed by signals)
+ */
+void clients_check() {
+	int i;
+	long c;
+	struct timemsg m;
+
+	for (i = 0; i < ALLCLIENTS; i++) {
+		c = clients[i];
+
+		if ((c == EMPTY && leases[i] != LAPSEDLEASE) || pids[i] == 0)
+			continue;
+
+		if (kill(pids[i], 0) == 0 || errno != ESRCH)
+			continue;
+
+		clients_lease(i, 0);
+		if (c == EMPTY)
+			continue;
+		while (-1 != msgrcv(shards[SHARD(i)].queue, &m, msgsize,
+				WAKE(i), IPC_NOWAIT))
+			;
+		if (c >= SLEEPING)
+			domainof(i)->numsleeping--;
+		clients[i] = EMPTY;
+		domainof(i)->numclients--;
+	}
+}
+
+/*
+ * client of a domain of first wakeup time
+ */
+long clients_next(struct domain *d) {
+	long c, min;
+
+	min = -1;
+
+	for (c = 0; c < ALLCLIENTS; c++)
+		if (clients[c] >= SLEEPING && domainof(c) == d &&
+		    (min == -1 || clients[c] < clients[min]))
+		    	min = c;
+
+	return min;
+}
+
+/*
+ * plugin
+ *
+ * with -P, the policies of the server are steered by a shared object; its
+ * functions are called under the lock, and those it does not define keep the
+ * usual behavior (see timeplugin.h); it sees the domain of each call
+ */
+struct timeplugin plugin;
+int (* plugin_init)(struct timeplugin *p, char *arg);
+void (* plugin_event)(struct timeplugin *p, long mtype, long client,
+	long time);
+long (* plugin_query)(struct timeplugin *p, long client, long advance);
+long (* plugin_jump)(struct timeplugin *p, long next, int timeout);
+void (* plugin_order)(struct timeplugin *p, long *clients, int n);
+void (* plugin_fini)(struct timeplugin *p);
+
+void plugin_domain(struct domain *d) {
+	plugin.now = &d->now;
+	plugin.end = &d->end;
+	plugin.origin = d->origin;
+	plugin.numclients = &d->numclients;
+	plugin.numsleeping = &d->numsleeping;
+	plugin.domain = d - domains;
+}
+
+int plugin_load(char *arg) {
+	char *colon;
+	void *handle;
+
+	colon = strchr(arg, ':');
+	if (colon != NULL)
+		*colon++ = '\0';
+
+	handle = dlopen(arg, RTLD_NOW);
+	if (handle == NULL) {
+		fprintf(stderr, "%s\n", dlerror());
+		return -1;
+	}
+	plugin_init = dlsym(handle, "timeplugin_init");
+	plugin_event = dlsym(handle, "timeplugin_event");
+	plugin_query = dlsym(handle, "timeplugin_query");
+	plugin_jump = dlsym(handle, "timeplugin_jump");
+	plugin_order = dlsym(handle, "timeplugin_order");
+	plugin_fini = dlsym(handle, "timeplugin_fini");
+
+	plugin.version = TIMEPLUGIN_VERSION;
+	plugin.clients = clients;
+	plugin.pids = pids;
+	plugin.size = MAXSHARDS * MAXCLIENTS;
+	plugin.data = NULL;
+	plugin.domains = clientdomain;
+	plugin_domain(&domains[0]);
+
+	if (plugin_init != NULL &&
+	    plugin_init(&plugin, colon) != TIMEPLUGIN_VERSION) {
+		fprintf(stderr, "%s: not initialized\n", arg);
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * stall attribution
+ *
+ * a timeout means that the clients of a domain that were not sleeping did not
+ * talk to the server for idletime microseconds; this wall-clock time is added
+ * to each of them, by pid and command name, since a process may execute
+ * another program
+ *
+ * the clients are taken under the lock at the timeout, and their command
+ * names are read from /proc by stalls_flush() after releasing it; the
+ * processes beyond MAXSTALLS are not attributed, but counted as dropped
+ */
+#define MAXSTALLS 1000
+#define TOPSTALLS 10
+struct stall {
+	long pid;
+	char command[20];
+	long timeouts;
+	long usec;
+} stalls[MAXSTALLS];
+int numstalls;
+long droppedstalls;
+
+struct stall stalled[MAXSHARDS * MAXCLIENTS];
+int numstalled;
+
+void stalls_add(struct domain *d, long usec) {
+	int c;
+
+	for (c = 0; c < ALLCLIENTS; c++) {
+		if (clients[c] != RUNNING || domainof(c) != d)
+			continue;
+		if (numstalled >= MAXSHARDS * MAXCLIENTS)
+			break;
+		stalled[numstalled].pid = pids[c];
+		snprintf(stalled[numstalled].command, 20, "client %d", c);
+		stalled[numstalled].usec = usec;
+		numstalled++;
+	}
+}
+
+void stalls_flush() {
+	int i, s, fd, len;
+	char path[40], *command;
+
+	for (i = 0; i < numstalled; i++) {
+		if (stalled[i].pid == 0)
+			continue;
+		command = stalled[i].command;
+		snprintf(path, 40, "/proc/%ld/comm", stalled[i].pid);
+		fd = open(path, O_RDONLY);
+		len = fd == -1 ? -1 : read(fd, command, 19);
+		if (fd != -1)
+			close(fd);
+		if (len <= 0)
+			strcpy(command, "(dead)");
+		else
+			command[command[len - 1] == '\n' ?
+				len - 1 : len] = '\0';
+	}
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < numstalled; i++) {
+		for (s = 0; s < numstalls; s++)
+			if (stalls[s].pid == stalled[i].pid &&
+			    ! strcmp(stalls[s].command, stalled[i].command))
+				break;
+		if (s == numstalls) {
+			if (numstalls >= MAXSTALLS) {
+				droppedstalls++;
+				continue;
+			}
+			numstalls++;
+			stalls[s].pid = stalled[i].pid;
+			strcpy(stalls[s].command, stalled[i].command);
+			stalls[s].timeouts = 0;
+			stalls[s].usec = 0;
+		}
+		stalls[s].timeouts++;
+		stalls[s].usec += stalled[i].usec;
+	}
+	numstalled = 0;
+	pthread_mutex_unlock(&lock);
+}
+
+int stalls_compare(const void *a, const void *b) {
+	long ua, ub;
+
+	ua = ((struct stall *) a)->usec;
+	ub = ((struct stall *) b)->usec;
+	return ua < ub ? 1 : ua > ub ? -1 : 0;
+}
+
+void stalls_report(FILE *out) {
+	int s;
+
+	pthread_mutex_lock(&lock);
+	qsort(stalls, numstalls, sizeof(struct stall), stalls_compare);
+	fprintf(out, "stalls: %-8s %-16s %-9s %s\n",
+		"pid", "command", "timeouts", "seconds");
+	for (s = 0; s < numstalls && s < TOPSTALLS; s++)
+		fprintf(out, "        %-8ld %-16s %-9ld %ld.%03ld\n",
+			stalls[s].pid, stalls[s].command, stalls[s].timeouts,
+			stalls[s].usec / 1000000,
+			stalls[s].usec % 1000000 / 1000);
+	if (droppedstalls > 0)
+		fprintf(out, "        dropped %ld timeouts of processes beyond "
+			"the first %d\n", droppedstalls, MAXSTALLS);
+	pthread_mutex_unlock(&lock);
+	fflush(out);
+}
+
+/*
+ * idleness from /proc
+ *
+ * a client is idle if none of the threads of its process and of its
+ * descendants is running or waiting for the disk, and they used no cpu time
+ * since the previous check; the descendants include the children that did
+ * not yet register, or never will since they do not call functions about time;
+ * the clients on other hosts and those without a pid are never idle
+ */
+#define MINPROBE 1000
+#define MAXDEPTH 8
+
+int proc_idle(long pid, long *cpu, int depth) {
+	DIR *dir;
+	struct dirent *e;
+	FILE *f;
+	char path[300], line[1000], *p;
+	long ns, child;
+	int idle;
+
+	snprintf(path, 300, "/proc/%ld/task", pid);
+	dir = opendir(path);
+	if (dir == NULL)
+		return errno == ENOENT;
+
+	idle = 1;
+	while (idle && (e = readdir(dir)) != NULL) {
+		if (e->d_name[0] == '.')
+			continue;
+
+		snprintf(path, 300, "/proc/%ld/task/%s/stat", pid, e->d_name);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		p = fgets(line, 1000, f) == NULL ? NULL : strrchr(line, ')');
+		fclose(f);
+		if (p != NULL && (p[2] == 'R' || p[2] == 'D'))
+			idle = 0;
+
+		snprintf(path, 300, "/proc/%ld/task/%s/schedstat",
+			pid, e->d_name);
+		f = fopen(path, "r");
+		if (f != NULL) {
+			if (fscanf(f, "%ld", &ns) == 1)
+				*cpu += ns;
+			fclose(f);
+		}
+
+		snprintf(path, 300, "/proc/%ld/task/%s/children",
+			pid, e->d_name);
+		f = fopen(path, "r");
+		if (f == NULL || depth >= MAXDEPTH)
+			idle = 0;
+		else
+			while (idle && fscanf(f, "%ld", &child) == 1)
+				idle = proc_idle(child, cpu, depth + 1);
+		if (f != NULL)
+			fclose(f);
+	}
+	closedir(dir);
+	return idle;
+}
+
+/*
+ * the pids are taken under the lock and /proc is read without it, not to
+ * stall the shards for the whole scan; the clients that registered meanwhile
+ * are not idle, those that unregistered are skipped
+ */
+long idleclient[MAXSHARDS * MAXCLIENTS], idlepid[MAXSHARDS * MAXCLIENTS];
+long idlecpu[MAXSHARDS * MAXCLIENTS];
+int idlebusy[MAXSHARDS * MAXCLIENTS];
+
+int clients_idle() {
+	int c, i, n, idle;
+
+	n = 0;
+	pthread_mutex_lock(&lock);
+	for (c = 0; c < ALLCLIENTS; c++) {
+		if (clients[c] == EMPTY)
+			continue;
+		idleclient[n] = c;
+		idlepid[n] = pids[c];
+		n++;
+	}
+	pthread_mutex_unlock(&lock);
+
+	for (i = 0; i < n; i++) {
+		idlecpu[i] = 0;
+		idlebusy[i] = idlepid[i] == 0 ||
+			! proc_idle(idlepid[i], &idlecpu[i], 0);
+	}
+
+	idle = 1;
+	pthread_mutex_lock(&lock);
+	for (c = 0, i = 0; c < ALLCLIENTS; c++) {
+		if (i >= n || idleclient[i] != c) {
+			if (clients[c] != EMPTY)
+				idle = 0;
+			continue;
+		}
+		if (clients[c] != EMPTY && pids[c] != idlepid[i])
+			idle = 0;
+		else if (clients[c] != EMPTY) {
+			if (idlebusy[i] || idlecpu[i] != cputime[c])
+				idle = 0;
+			cputime[c] = idlecpu[i];
+		}
+		i++;
+	}
+	pthread_mutex_unlock(&lock);
+	return idle;
+}
+
+/*
+ * record and replay
+ *
+ * the trace has a line for each decision of the server: microseconds of wall
+ * clock since start, simulated time of the domain, message type, client and
+ * time field of the message; the seed of the random number generator is
+ * recorded as a message of type NONE, timeouts with time 1 and instant jumps
+ * with time 0, their domain as client, woken clients as messages of type
+ * WAKE(client), the messages waiting for the run of their domain once more
+ * on arrival as DEFERRED(mtype); registrations are matched by the tag that
+ * clients send with them, so that each client obtains the same id it had in
+ * the recorded run
+ *
+ * when replaying, the messages from the clients are processed in the order of
+ * the trace; the ones that arrive early are kept in the pending list until
+ * their turn; timeouts, runs and lapsed leases are taken from the trace
+ * without waiting; the replay stops at the end of the trace or when an
+ * expected message does not arrive; truncating the trace stops the replay at
+ * a chosen point
+ *
+ * the pending list also keeps the messages about time of the domains that are
+ * not running, received by any shard (see shards)
+ */
+FILE *record, *replay;
+struct timeval started;
+struct timemsg expected;
+long expectedline;
+
+#define MAXPENDING (MAXSHARDS * MAXCLIENTS)
+struct timemsg pending[MAXPENDING];
+int numpending;
+
+#define REPLAYPATIENCE 100
+
+void trace(struct domain *d, long mtype, long client, long time) {
+	struct timeval tv;
+
+	if (record == NULL)
+		return;
+
+	gettimeofday(&tv, NULL);
+	fprintf(record, "%ld %ld %ld %ld %ld\n",
+		(tv.tv_sec - started.tv_sec) * 1000000 +
+		tv.tv_usec - started.tv_usec,
+		d->now, mtype, client, time);
+}
+
+/*
+ * read the next expected message from the trace, skipping the wakeups and
+ * the deferred messages; return 0 at the end of the trace
+ */
+int trace_next() {
+	long wall, simulated;
+	int res;
+
+	do {
+		res = fscanf(replay, "%ld %ld %ld %ld %ld", &wall, &simulated,
+			&expected.mtype, &expected.client, &expected.time);
+		expectedline++;
+	} while (res == 5 && expected.mtype >= WAKE(0));
+
+	if (res == 5)
+		return 1;
+
+	fclose(replay);
+	replay = NULL;
+	return 0;
+}
+
+/*
+ * whether a message is the expected one: registrations are matched by tag,
+ * messages from clients by client
+ */
+int trace_match(struct timemsg *m) {
+	if (m->mtype != expected.mtype)
+		return 0;
+	if (m->mtype == REGISTER)
+		return m->time == expected.time;
+	if (m->mtype == RUN)
+		return 1;
+	return m->client == expected.client;
+}
+
+void trace_diverged() {
+	fprintf(stderr, "replay diverged at line %ld\n", expectedline);
+	fclose(replay);
+	replay = NULL;
+}
+
+/*
+ * print a time of a domain, and the domain if more than one; the time is
+ * taken under the lock by the caller, since the log is written outside it
+ */
+void printtime(FILE *out, struct domain *d, long now) {
+	char line[30];
+	time_t cur;
+	struct tm date;
+
+	if (numdomains > 1)
+		fprintf(out, "%-7ld", (long) (d - domains));
+
+	if (dates) {
+		cur = d->origin + now;
+		localtime_r(&cur, &date);
+		strftime(line, 25, "%F %T", &date);
+		fprintf(out, "%-25s", line);
+	}
+
+	fprintf(out, "%-9ld", now);
+}
+
+/*
+ * broadcast wakeups: a client that sent BROADCAST is woken by counting its
+ * wakeup in the state, and the buckets of the clients are released by
+ * wake_flush() with a system call each, however many clients they wake
+ */
+int flush[WAKEBUCKETS], numflush;
+
+void wake_broadcast(long client) {
+	__atomic_store_n(&wakeups[client], wakeups[client] + 1,
+		__ATOMIC_RELEASE);
+	if (! flush[WAKEBUCKET(client)])
+		numflush++;
+	flush[WAKEBUCKET(client)] = 1;
+}
+
+void wake_flush() {
+	int b;
+
+	for (b = 0; b < WAKEBUCKETS && numflush > 0; b++) {
+		if (! flush[b])
+			continue;
+		flush[b] = 0;
+		numflush--;
+		__atomic_add_fetch(&state->buckets[b], 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &state->buckets[b], FUTEX_WAKE, INT_MAX,
+			NULL, NULL, 0);
+	}
+}
+
+/*
+ * wake the clients of a domain from first to last whose wakeup time has come
+ */
+void wake(FILE *out, struct domain *d, long first, long last) {
+	static long due[MAXSHARDS * MAXCLIENTS];
+	long client;
+	int n, i, broadcasts, ended, broadcastended;
+
+	/* the clients woken by broadcast read the time from the state */
+	state->domains[d - domains].now = d->now;
+
+	for (n = 0, client = first; client < last; client++)
+		if (clients[client] >= SLEEPING &&
+		    clients[client] - SLEEPING < d->now &&
+		    domainof(client) == d)
+			due[n++] = client;
+	if (n > 1 && plugin_order != NULL) {
+		plugin_domain(d);
+		plugin_order(&plugin, due, n);
+	}
+
+	broadcasts = 0;
+	broadcastended = 0;
+	for (i = 0; i < n; i++) {
+		client = due[i];
+		if (clients[client] < SLEEPING)
+			continue;
+
+		ended = d->end == NEXTWAKE;
+		if (ended)
+			d->end = d->now + 1;
+
+		trace(d, WAKE(client), client, d->origin + d->now);
+		if (broadcast[client]) {
+			wake_broadcast(client);
+			clients[client] = RUNNING;
+			d->numsleeping--;
+			broadcasts++;
+			broadcastended |= ended;
+			continue;
+		}
+
+		printtime(out, d, d->now);
+		fprintf(out, " %-8s %-15s", "", "");
+		fprintf(out, " wake(%ld)", client);
+		if (ended)
+			fprintf(out, " end=%ld", d->end);
+		fprintf(out, "\n");
+
+		reply_wake(client, 0);
+		clients[client] = RUNNING;
+		d->numsleeping--;
+	}
+
+	/* a line and a system call for each wakeup time */
+	if (broadcasts > 0) {
+		printtime(out, d, d->now);
+		fprintf(out, " %-8s %-15s", "", "");
+		fprintf(out, " broadcast(%d)", broadcasts);
+		if (broadcastended)
+			fprintf(out, " end=%ld", d->end);
+		fprintf(out, "\n");
+		wake_flush();
+	}
+}
+
+/*
+ * receive a message from the queue; when the simulation is running, wait at
+ * most idletime microseconds, then return a TIMEOUT message for all domains;
+ * return 1 for a timeout, -1 on error and termination
+ *
+ * with -a or -c, the clients are checked for idleness after MINPROBE
+ * microseconds, then at doubling intervals while they are busy; if idle, a
+ * TIMEOUT message is returned with 0, as for an instant jump
+ */
+int receive(struct shard *sh, int running, long idletime) {
+	int res, err, queue, deferring;
+	long wait, waited, probe;
+
+	/* while no domain runs, the messages about time are still read if
+	 * they can be kept pending, so that the trace tells when they came */
+	deferring = ! running &&
+		__atomic_load_n(&numpending, __ATOMIC_RELAXED) < MAXPENDING;
+
+	if (shard_fetch(sh, &msg, running || deferring) == 0)
+		return msgsize;
+
+	queue = sh->queue;
+	timeout = 0;
+	waited = 0;
+	probe = MINPROBE;
+
+	do {
+		if (reporting) {
+			reporting = 0;
+			stalls_report(stdout);
+			queues_report(stdout);
+		}
+
+		if (! running) {
+			/* simulation run ended, not yet (re)started:
+			 * the messages related to time are deferred */
+			res = msgrcv(queue, &msg, msgsize,
+				deferring ? -TOSERVER : -NOTRUNNING, 0);
+			err = errno;
+		}
+		else if (idleness && replay == NULL) {
+			/* wait for the next check of idleness */
+			wait = MIN(probe, idletime - waited);
+			settimer(wait);
+			res = msgrcv(queue, &msg, msgsize, -TOSERVER, 0);
+			err = errno;
+			settimer(0);
+			if (res != -1 || err != EINTR || ! timeout || terminated)
+				continue;
+
+			waited += wait;
+			if (waited >= idletime)
+				break;
+			if (cgroup != NULL ? cgroup_idle() : clients_idle()) {
+				/* a message sent just before the check */
+				res = msgrcv(queue, &msg, msgsize, -TOSERVER,
+					IPC_NOWAIT);
+				if (res != -1)
+					return res;
+				msg.mtype = TIMEOUT;
+				msg.client = ALLDOMAINS;
+				return 0;
+			}
+			probe = MIN(probe * 2, idletime);
+			timeout = 0;
+		}
+		else {
+			/* simulation is running: wait for some time for
+			 * messages from the client */
+			settimer(idletime);
+			res = msgrcv(queue, &msg, msgsize, -TOSERVER, 0);
+			err = errno;
+			settimer(0);
+		}
+	} while (res == -1 && err == EINTR && ! terminated && (reporting ||
+	         (running && idleness && replay == NULL && ! timeout)));
+
+	if (res == -1 && err == EINTR && timeout && ! terminated) {
+		msg.mtype = TIMEOUT;
+		msg.client = ALLDOMAINS;
+		return 1;
+	}
+
+	return res;
+}
+
+/*
+ * take the first pending message that can be processed, of a domain running
+ * or not about time; the other shards add to the list under the lock
+ */
+int pending_take(struct timemsg *m) {
+	int i;
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < numpending; i++)
+		if (pending[i].mtype < NOTRUNNING ||
+		    running(domainof(pending[i].client))) {
+			*m = pending[i];
+			numpending--;
+			memmove(pending + i, pending + i + 1,
+				(numpending - i) * sizeof(pending[0]));
+			pthread_mutex_unlock(&lock);
+			return 0;
+		}
+	pthread_mutex_unlock(&lock);
+	return -1;
+}
+
+/*
+ * receive the next message in the order of the trace being replayed, or
+ * the messages kept aside during the replay once it ended
+ */
+int receive_replay(struct shard *sh, int running, long idletime) {
+	int i, res;
+
+	if (replay == NULL) {
+		if (pending_take(&msg) == 0)
+			return 0;
+		return receive(sh, running, idletime);
+	}
+
+	if (expected.mtype == TIMEOUT || expected.mtype == RUN ||
+	    expected.mtype == LAPSED) {
+		msg = expected;
+		res = expected.mtype == TIMEOUT ? expected.time : 0;
+		trace_next();
+		return res;
+	}
+
+	pthread_mutex_lock(&lock);
+	for (i = 0; i < numpending; i++)
+		if (trace_match(&pending[i])) {
+			msg = pending[i];
+			numpending--;
+			memmove(pending + i, pending + i + 1,
+				(numpending - i) * sizeof(pending[0]));
+			pthread_mutex_unlock(&lock);
+			trace_next();
+			return 0;
+		}
+	pthread_mutex_unlock(&lock);
+
+	while (1) {
+		res = receive(sh, running, idletime * REPLAYPATIENCE);
+		if (res == -1)
+			return -1;
+		if (msg.mtype == TIMEOUT || numpending >= MAXPENDING) {
+			trace_diverged();
+			return res;
+		}
+		if (trace_match(&msg)) {
+			trace_next();
+			return res;
+		}
+		pthread_mutex_lock(&lock);
+		pending[numpending++] = msg;
+		pthread_mutex_unlock(&lock);
+	}
+}
+
+/*
+ * scaled real time: while some clients of a domain are running, advance its
+ * time by the real time elapsed since the last call multiplied by scale, up to
+ * the next wakeup and the end of the run
+ */
+int flowing(struct domain *d) {
+	return scale > 0 && running(d) && d->numsleeping < d->numclients;
+}
+
+void flow(FILE *out) {
+	struct timeval tv;
+	struct domain *d;
+	long client, next, seconds;
+
+	gettimeofday(&tv, NULL);
+
+	pthread_mutex_lock(&lock);
+	for (d = domains; d < domains + numdomains; d++) {
+		if (! flowing(d)) {
+			d->fraction = 0;
+			d->flowed = tv;
+			continue;
+		}
+
+		d->fraction += scale * ((tv.tv_sec - d->flowed.tv_sec) +
+			(tv.tv_usec - d->flowed.tv_usec) / 1000000.0);
+		d->flowed = tv;
+		seconds = (long) d->fraction;
+		d->fraction -= seconds;
+
+		next = d->now + seconds;
+		client = clients_next(d);
+		if (client != -1 && next > clients[client] - SLEEPING + 1)
+			next = clients[client] - SLEEPING + 1;
+		if (d->end >= 0 && next > d->end)
+			next = d->end;
+		if (next > d->now) {
+			d->now = next;
+			wake(out, d, 0, ALLCLIENTS);
+			state_update();
+		}
+	}
+	pthread_mutex_unlock(&lock);
+}
+
+/*
+ * the domain of a message: in the client field for RUN and TIMEOUT, domain 0
+ * for the clients registering, NULL if out of range
+ */
+struct domain *message_domain(struct timemsg *m) {
+	if (m->mtype == RUN || m->mtype == TIMEOUT)
+		return m->client >= 0 && m->client < numdomains ?
+			&domains[m->client] : NULL;
+	if (m->mtype == NONE || m->mtype == REGISTER)
+		return &domains[0];
+	return m->client >= 0 && m->client < MAXSHARDS * MAXCLIENTS ?
+		domainof(m->client) : NULL;
+}
+
+/*
+ * process a message received by a shard; res tells whether a TIMEOUT message
+ * is a real timeout or an instant jump
+ *
+ * all time variables are in number of seconds, always starting from 0 even if
+ * -t is given; this option only provides an offset of all time sent to client,
+ * but is otherwise internally ignored; they are of the domain of the message
+ *
+ * now		current time in the simulation
+ * end		end of the current simulation run
+ *		the run is over when now == end
+ *		if end < 0 the run end depends on what the clients do:
+ *		NEXTSLEEP: end when one of the clients sleeps or unregister
+ *		NEXTWAKE: end when one of the clients wakes
+ * client[c] - SLEEPING
+ *		if >=0, is the wakeup time for client c
+ *		client is woken when now > this
+ */
+void process(struct shard *sh, struct timemsg *m, int res) {
+	FILE *out;
+	struct domain *d, *e;
+	long client, t, before, advance;
+	struct timemsg w;
+	char line[200];
+	int deferred;
+
+	out = sh->log;
+
+	d = message_domain(m);
+	if (d == NULL) {
+		fprintf(out, "unknown client or domain: %ld %ld\n",
+			m->mtype, m->client);
+		return;
+	}
+
+	if ((m->mtype > NOTRUNNING || m->mtype == PID ||
+	     m->mtype == UNREGISTER) &&
+	    m->client >= 0 && m->client < MAXSHARDS * MAXCLIENTS)
+		__atomic_add_fetch(&messages[m->client], 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&lock);
+	d->active = wallclock();
+
+				/* messages about time wait for the run */
+
+	deferred = 0;
+	while (m->mtype > NOTRUNNING && ! running(d) && ! terminated) {
+		if (! deferred)
+			trace(d, DEFERRED(m->mtype), m->client, m->time);
+		deferred = 1;
+		/* the main thread cannot wait, since it receives the runs;
+		 * the others would block the clients of the other domains */
+		if (numpending < MAXPENDING) {
+			pending[numpending++] = *m;
+			pthread_mutex_unlock(&lock);
+			return;
+		}
+		if (sh == shards)
+			break;
+		pthread_cond_wait(&runcond, &lock);
+	}
+	if (terminated) {
+		pthread_mutex_unlock(&lock);
+		return;
+	}
 
-#include <stdlib.h>
-#include <stdio.h>
-#include <unistd.h>
-#include <sys/msg.h>
-#include <errno.h>
-#include <signal.h>
-#include <string.h>
-#include <time.h>
-#include <sys/time.h>
+	/* under the lock, in the order of processing */
+	trace(d, m->mtype, m->client, m->mtype == TIMEOUT ? res : m->time);
+
+				/* query: reply outside the lock */
+
+	if (m->mtype == QUERY) {
+		t = d->now;
+		pthread_mutex_unlock(&lock);
+
+		client = m->client;
+		reply(client, TIME(client),
+			(m->time == MONOTONIC ? 0 : d->origin) + t);
+
+		printtime(out, d, t);
+		fprintf(out, " %-8ld", client);
+		fprintf(out, " %-15s", "query()");
+		fprintf(out, "\n");
+
+		advance = busywait && rand_r(&sh->seed) % busywait == 0;
+		if (advance || plugin_query != NULL) {
+			pthread_mutex_lock(&lock);
+			/* another shard may have ended the run meanwhile */
+			if (running(d) && ! terminated) {
+				before = d->now;
+				if (plugin_query != NULL) {
+					plugin_domain(d);
+					advance = plugin_query(&plugin, client,
+						advance);
+				}
+				if (advance > 0)
+					d->now += advance;
+				if (d->end >= 0 && d->now > d->end)
+					d->now = d->end;
+				if (d->now < before)
+					d->now = before;
+				if (d->now != before)
+					wake(out, d, 0, ALLCLIENTS);
+				state_update();
+			}
+			pthread_mutex_unlock(&lock);
+		}
+		return;
+	}
 
-#include "timecontrol.h"
+	before = d->now;
+	printtime(out, d, d->now);
 
-#define MIN(a,b) (((a) < (b)) ? (a) : (b))
+	switch (m->mtype) {
 
-/*
- * interrupts are used only to stop msgrcv
- */
-int timeout;
-int terminated;
-void handler(int s) {
-	// printf("signal: %d\n", s);
+	case NONE:
+		fprintf(out, " %-8s %-15s", "", "none()");
+		break;
 
-	if (s == SIGALRM && ! terminated)
-		timeout = 1;
+	case REGISTER:
+		fprintf(out, " %-8s %-15s", "", "register()");
+
+		clients_check();
+
+		if (sh->sock != -1)
+			client = clients_register(sh - shards, 0);
+		else
+			client = clients_register(m->client > 0 ?
+				m->client % numshards : 0, 1);
+		/* with all ids taken, the reply tells the client to run on
+		 * real time; the others keep being served */
+		if (client == -1)
+			fprintf(out, " cannot register");
+		else {
+			fprintf(out, " id=%ld", client);
+			d->numclients++;
+		}
+
+		m->mtype = m->client > 0 ? REGISTERED(m->client) : CLIENTID;
+		m->client = client;
+		m->time = d->origin + d->now;
+		shard_send(sh, m);
+		break;
+
+	case UNREGISTER:
+		fprintf(out, " %-8ld %-15s", m->client, "unregister()");
+
+		/* a program that attached late may end without the pid */
+		if (clients[m->client] == EMPTY) {
+			clients_lease(m->client, 0);
+			break;
+		}
+		clients_unregister(m->client);
+		d->numclients--;
+
+		if (d->end == NEXTSLEEP) {
+			d->end = d->now;
+			fprintf(out, " end=%ld", d->end);
+		}
+		break;
+
+	case PID:
+		fprintf(out, " %-8ld", m->client);
+		sprintf(line, "pid(%ld)", m->time);
+		fprintf(out, " %-15s", line);
+
+		/* the pid of a client on another host cannot be checked
+		 * here; its timerelay unregisters it when it dies */
+		pids[m->client] = sh->sock == -1 ? m->time : 0;
+
+		/* the end of the lease of exec(), even if lapsed */
+		if (leases[m->client] == LAPSEDLEASE) {
+			fprintf(out, " late");
+			clients[m->client] = RUNNING;
+			d->numclients++;
+		}
+		clients_lease(m->client, 0);
+		break;
+
+	case EXEC:
+		fprintf(out, " %-8ld %-15s", m->client, "exec()");
+
+		clients_lease(m->client, wallclock() + idletime);
+		break;
+
+	case LAPSED:
+		fprintf(out, " %-8ld %-15s", m->client, "lapsed()");
+
+		/* the new program did not attach: the client is gone */
+		if (leases[m->client] <= 0 || clients[m->client] == EMPTY)
+			break;
+		while (-1 != msgrcv(shards[SHARD(m->client)].queue, &w,
+				msgsize, WAKE(m->client), IPC_NOWAIT))
+			;
+		if (clients[m->client] >= SLEEPING)
+			d->numsleeping--;
+		clients[m->client] = EMPTY;
+		clients_lease(m->client, LAPSEDLEASE);
+		d->numclients--;
+
+		if (d->end == NEXTSLEEP) {
+			d->end = d->now;
+			fprintf(out, " end=%ld", d->end);
+		}
+		break;
+
+	case TIMEOUT:
+		fprintf(out, " %-8s", "");
+		fprintf(out, " %-15s", res ? "timeout()" : "jump()");
+
+		/* a replayed timeout is not waited */
+		if (res && replay == NULL)
+			stalls_add(d, idletime);
+
+		clients_check();
+		client = clients_next(d);
+
+		if (idlejump != -1) {
+			d->now += idlejump;
+			if (d->now >= d->end && d->end >= 0)
+				d->now = d->end;
+			if (client != -1 &&
+			    d->now > clients[client] - SLEEPING + 1)
+				d->now = clients[client] - SLEEPING + 1;
+		}
+		else {
+			if (client != -1 &&
+			    (clients[client] - SLEEPING < d->end ||
+			     d->end < 0))
+				d->now = clients[client] - SLEEPING + 1;
+			else if (d->end >= 0)
+				d->now = d->end;
+			else if (nofork)
+				d->end = d->now;
+		}
+
+		if (plugin_jump != NULL) {
+			t = d->now;
+			d->now = before;
+			plugin_domain(d);
+			d->now = plugin_jump(&plugin, t, res);
+			if (d->end >= 0 && d->now > d->end)
+				d->now = d->end;
+			if (d->now < before)
+				d->now = before;
+		}
+
+		fprintf(out, " now=%ld end=%ld", d->now, d->end);
+
+		break;
+
+	case RUN:
+		fprintf(out, " %-8s", "");
+		sprintf(line, "run(%ld)", m->time);
+		fprintf(out, " %-15s", line);
+
+		d->end = m->time < 0 ? m->time : d->end + m->time;
+		pthread_cond_broadcast(&runcond);
+
+		fprintf(out, " end=%ld", d->end);
+		break;
+
+	case BROADCAST:
+		client = m->client;
+
+		fprintf(out, " %-8ld", client);
+		sprintf(line, "broadcast(%ld)", m->time);
+		fprintf(out, " %-15s", line);
+
+		/* only sent by the clients that attached the state, which
+		 * the clients of a timerelay cannot; no reply */
+		broadcast[client] = m->time && sh->sock == -1 && stateid != -1;
+		fprintf(out, " %s", broadcast[client] ? "on" : "off");
+		break;
+
+	case DOMAIN:
+		client = m->client;
+
+		fprintf(out, " %-8ld", client);
+		sprintf(line, "domain(%ld)", m->time);
+		fprintf(out, " %-15s", line);
+
+		/* a client moves before its first message about time; the
+		 * reply tells its domain, unchanged if unknown, and time */
+		if (m->time >= 0 && m->time < numdomains &&
+		    clients[client] == RUNNING) {
+			e = &domains[m->time];
+			d->numclients--;
+			e->numclients++;
+			e->active = wallclock();
+			clientdomain[client] = m->time;
+		}
+		else
+			fprintf(out, " unknown");
+		e = domainof(client);
+		m->mtype = TIME(client);
+		m->client = clientdomain[client];
+		m->time = e->origin + e->now;
+		shard_send(&shards[SHARD(client)], m);
+		break;
+
+	case SLEEP:
+	case SLEEPUNTIL:
+	case SLEEPUNTILMONO:
+		client = m->client;
+
+		fprintf(out, " %-8ld", client);
+		sprintf(line, "%s(%ld)", m->mtype == SLEEP ? "sleep" :
+			m->mtype == SLEEPUNTIL ? "sleepuntil" : "sleepmono",
+			m->time);
+		fprintf(out, " %-15s", line);
+
+		/* the seconds to sleep, from the deadline if given */
+		t = m->mtype == SLEEP ? m->time :
+			m->mtype == SLEEPUNTIL ? m->time - d->origin - d->now :
+			m->time - d->now;
+
+		/* a sleep of no time is woken at once: its wakeup time minus
+		 * one would read as RUNNING at time 0 */
+		if (t <= 0) {
+			fprintf(out, " wake(%ld)", client);
+			if (broadcast[client]) {
+				wake_broadcast(client);
+				wake_flush();
+			}
+			else
+				reply_wake(client, 0);
+			trace(d, WAKE(client), client, d->origin + d->now);
+		}
+		else {
+			clients[client] = SLEEPING + d->now + t - 1;
+			fprintf(out, " wakeup=%ld",
+				clients[client] - SLEEPING + 1);
+			d->numsleeping++;
+		}
+
+		if (d->end == NEXTSLEEP) {
+			d->end = d->now;
+			fprintf(out, " end=%ld", d->end);
+		}
+		break;
+
+	case CANCEL:
+		client = m->client;
+
+		fprintf(out, " %-8ld", client);
+		fprintf(out, " %-15s", "cancel()");
+		fprintf(out, " wakeup(%ld)", client);
+
+		/* the client learns the time left from the reply, without
+		 * asking the time before and after sleeping */
+		t = clients[client] >= SLEEPING ?
+			clients[client] - SLEEPING + 1 - d->now : 0;
+		fprintf(out, " left=%ld", t);
+		reply_wake(client, t);
+
+		if (clients[client] >= SLEEPING)
+			d->numsleeping--;
+		clients[client] = RUNNING;
+		break;
+
+	default:
+		fprintf(out, "unknown mtype: %ld\n", m->mtype);
+	}
+
+	fprintf(out, "\n");
+
+	if (plugin_event != NULL) {
+		plugin_domain(d);
+		plugin_event(&plugin, m->mtype, m->client,
+			m->mtype == TIMEOUT ? res : m->time);
+		if (d->now < before)
+			d->now = before;
+	}
+
+				/* wake clients */
+
+	if (d->now != before)
+		wake(out, d, 0, ALLCLIENTS);
 	else
-		terminated = 1;
+		wake(out, d, (sh - shards) * MAXCLIENTS,
+			(sh - shards + 1) * MAXCLIENTS);
+
+	state_update();
+	pthread_mutex_unlock(&lock);
 }
 
 /*
- * database of clients
+ * thread of a shard other than 0
  */
+void *shard_loop(void *arg) {
+	struct shard *sh;
+	struct timemsg m;
+	int res;
 
-#define MAXCLIENTS 200
-int numclients;
-int numsleeping;
-long clients[MAXCLIENTS];
-long pids[MAXCLIENTS];
-
-#define EMPTY 0
-#define RUNNING 1
-#define SLEEPING 2
+	sh = arg;
 
-void clients_init() {
-	int c;
-	for (c = 0; c < MAXCLIENTS; c++)
-		clients[c] = EMPTY;
-	numclients = 0;
-	numsleeping = 0;
-}
+	while (! terminated) {
+		res = shard_fetch(sh, &m, 1);
+		if (res == -1)
+			res = msgrcv(sh->queue, &m, msgsize, -TOSERVER, 0);
+		if (res == -1 && errno == EINTR)
+			continue;
+		if (res == -1)
+			break;
 
-int clients_register() {
-	int c;
-	for (c = 0; c < MAXCLIENTS; c++)
-		if (clients[c] == EMPTY) {
-			clients[c] = RUNNING;
-			pids[c] = 0;
-			return c;
-		}
-	return -1;
-}
+		process(sh, &m, 0);
+		shard_flush(sh);
+	}
 
-void clients_unregister(int c) {
-	if (c >= 0 && c < MAXCLIENTS)
-		clients[c] = EMPTY;
+	return NULL;
 }
 
 /*
- * remove clients that no longer exists (clients killed by signals)
+ * thread of a connection from a timerelay
  */
-void clients_check(int queue) {
-	int i;
+void *remote_loop(void *arg) {
+	struct shard *sh;
+	struct timemsg m;
 	long c;
 
-	for (i = 0; i < MAXCLIENTS; i++) {
-		c = clients[i];
+	sh = arg;
 
-		if (c == EMPTY || pids[i] == 0)
-			continue;
+	while (! terminated && net_recv(sh->sock, &sh->in, &m) == 1) {
+		process(sh, &m, 0);
+		if (! net_pending(&sh->in))
+			shard_flush(sh);
+	}
+	shard_flush(sh);
 
-		if (kill(pids[i], 0) == 0 || errno != ESRCH)
-			continue;
+				/* the clients of the host are lost */
 
-		while (-1 != msgrcv(queue, &msg, msgsize, WAKE(c), IPC_NOWAIT))
-			;
-		if (c >= SLEEPING)
-			numsleeping--;
-		clients[i] = EMPTY;
-		numclients--;
+	pthread_mutex_lock(&lock);
+	for (c = (sh - shards) * MAXCLIENTS;
+	     c < (sh - shards + 1) * MAXCLIENTS;
+	     c++) {
+		clients_lease(c, 0);
+		if (clients[c] == EMPTY)
+			continue;
+		if (clients[c] >= SLEEPING)
+			domainof(c)->numsleeping--;
+		clients[c] = EMPTY;
+		domainof(c)->numclients--;
 	}
+	close(sh->sock);
+	sh->sock = -1;
+	fclose(sh->log);
+	free(sh->buf);
+	sh->log = NULL;
+	pthread_mutex_unlock(&lock);
+
+	pthread_detach(pthread_self());
+	return NULL;
 }
 
 /*
- * client of first wakeup time
+ * accept connections from timerelay, each in a new shard
  */
-long clients_next() {
-	long c, min;
+int listener;
 
-	min = -1;
+void *listen_loop(void *arg) {
+	int fd, s;
+	struct shard *sh;
 
-	for (c = 0; c < MAXCLIENTS; c++)
-		if (clients[c] >= SLEEPING &&
-		    (min == -1 || clients[c] < clients[min]))
-		    	min = c;
+	(void) arg;
 
-	return min;
+	while (! terminated) {
+		fd = accept(listener, NULL, NULL);
+		if (fd == -1 && errno == EINTR)
+			continue;
+		if (fd == -1)
+			break;
+
+		pthread_mutex_lock(&lock);
+		for (s = numshards; s < MAXSHARDS; s++)
+			if (shards[s].sock == -1 && shards[s].log == NULL)
+				break;
+		if (s >= MAXSHARDS) {
+			pthread_mutex_unlock(&lock);
+			fprintf(stderr, "too many connections\n");
+			close(fd);
+			continue;
+		}
+		sh = &shards[s];
+		sh->sock = fd;
+		sh->in.start = 0;
+		sh->in.end = 0;
+		sh->log = open_memstream(&sh->buf, &sh->len);
+		if (s >= lastshard)
+			lastshard = s + 1;
+		pthread_mutex_unlock(&lock);
+
+		pthread_create(&sh->thread, NULL, remote_loop, sh);
+	}
+
+	return NULL;
 }
 
 /*
- * print time
+ * a timeout of the main thread, for the domain in the client field or for
+ * those whose clients sent no message for idletime; res 0 tells that the
+ * clients were found idle, and all domains running jump; a domain whose time
+ * flows does not jump, but the clients killed by signals are still to be
+ * found
  */
-void printtime(long origin, long now) {
-	char line[30];
-	long cur;
-	struct tm *date;
+void timeouts(struct timemsg *m, int res) {
+	struct timemsg t;
+	struct domain *d;
+	long wall;
+	int i, due;
+
+	/* the traces of a single domain may have any client */
+	if (numdomains == 1 && m->client != ALLDOMAINS)
+		m->client = 0;
+
+	wall = wallclock();
+	for (i = 0; i < numdomains; i++) {
+		if (m->client != ALLDOMAINS && m->client != i)
+			continue;
+		d = &domains[i];
+
+		pthread_mutex_lock(&lock);
+		due = m->client != ALLDOMAINS || (running(d) &&
+			(res == 0 || d->active + idletime <= wall));
+		if (due && res && flowing(d)) {
+			clients_check();
+			d->active = wall;
+			due = 0;
+		}
+		pthread_mutex_unlock(&lock);
 
-	if (origin != 0) {
-		cur = origin + now;
-		date = localtime(&cur);
-		strftime(line, 25, "%F %T", date);
-		printf("%-25s", line);
+		if (! due)
+			continue;
+		t = *m;
+		t.client = i;
+		process(&shards[0], &t, res);
 	}
-
-	printf("%-9ld", now);
+	stalls_flush();
+	shard_flush(&shards[0]);
 }
 
 /*
  * main
  *
- * all time variables are in number of seconds, always starting from 0 even if
- * -t is given; this option only provides an offset of all time sent to client,
- * but is otherwise internally ignored
- *
- * now		current time in the simulation
- * end		end of the current simulation run
- *		the run is over when now == end
- *		if end < 0 the run end depends on what the clients do:
- *		NEXTSLEEP: end when one of the clients sleeps or unregister
- *		NEXTWAKE: end when one of the clients wakes
- * client[c] - SLEEPING
- *		if >=0, is the wakeup time for client c
- *		client is woken when now > this
- *
  * interaction with clients is via a message queue; during a simulation run
  * (when now < end), messages are read from the queue with a timeout; this way,
  * if non-sleeping tasks are busy with other operations, some else is woken
@@ -188,27 +2029,38 @@ void printtime(long origin, long now) {
  */
 int main(int argn, char *argv[]) {
 	int opt;
-	int idletime, idlejump, busywait, nofork;
-	int queue;
 	key_t key;
-	int res, err;
-	struct itimerval timer;
-	long client;
-	long origin, now, end;
-	char line[200];
+	int res, jump, expired, run, s;
+	unsigned int seed;
+	long wait, wall, lapsed;
+	sigset_t blocked;
+	char *address, *origins;
+	pthread_t listening, retrying;
+	char *pluginarg;
+	struct domain *d;
 
 				/* arguments */
 
-	origin = 0;
+	origins = NULL;
+	numdomains = 1;
 	idletime = 50000;
 	idlejump = -1;
 	busywait = 2;
 	nofork = 0;
-	while (-1 != (opt = getopt(argn, argv, "t:i:j:b:fh")))
+	idleness = 0;
+	numshards = 1;
+	scale = 0;
+	address = NULL;
+	cgroup = NULL;
+	qbytes = 0;
+	pluginarg = NULL;
+	record = NULL;
+	replay = NULL;
+	while (-1 != (opt = getopt(argn, argv,
+			"t:i:j:b:fr:p:s:k:l:ac:q:P:d:h")))
 		switch (opt) {
 		case 't':
-			origin = ! strcmp(optarg, "now") ?
-				time(NULL) : atol(optarg);
+			origins = optarg;
 			break;
 		case 'i':
 			idletime = atol(optarg);
@@ -222,24 +2074,138 @@ int main(int argn, char *argv[]) {
 		case 'f':
 			nofork = 1;
 			break;
+		case 'r':
+			record = fopen(optarg, "w");
+			if (record == NULL) {
+				perror(optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'p':
+			replay = fopen(optarg, "r");
+			if (replay == NULL) {
+				perror(optarg);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 's':
+			numshards = atoi(optarg);
+			if (numshards < 1 || numshards > MAXSHARDS) {
+				printf("shards must be between 1 and %d\n",
+					MAXSHARDS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'k':
+			scale = atof(optarg);
+			break;
+		case 'l':
+			address = optarg;
+			break;
+		case 'a':
+			idleness = 1;
+			break;
+		case 'c':
+			cgroup = optarg;
+			idleness = 1;
+			if (cgroup_init() == -1)
+				exit(EXIT_FAILURE);
+			break;
+		case 'q':
+			qbytes = atol(optarg);
+			break;
+		case 'P':
+			pluginarg = optarg;
+			break;
+		case 'd':
+			numdomains = atoi(optarg);
+			if (numdomains < 1 || numdomains > MAXDOMAINS) {
+				printf("domains must be between 1 and %d\n",
+					MAXDOMAINS);
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'h':
 			printf("usage:...\n");
 			break;
 		}
-	srandom(time(NULL) + getpid());
+	if (replay != NULL && numshards != 1) {
+		printf("replay requires a single shard\n");
+		exit(EXIT_FAILURE);
+	}
+
+				/* origin of each domain */
+
+	dates = 0;
+	for (s = 0; s < numdomains; s++) {
+		d = &domains[s];
+		d->origin = origins == NULL ? 0 :
+			! strncmp(origins, "now", 3) ? time(NULL) :
+			atol(origins);
+		if (d->origin != 0)
+			dates = 1;
+		if (origins != NULL && strchr(origins, ',') != NULL)
+			origins = strchr(origins, ',') + 1;
+	}
+
+				/* random seed, possibly from the trace */
+
+	gettimeofday(&started, NULL);
+	seed = time(NULL) + getpid();
+	if (replay != NULL) {
+		if (! trace_next() || expected.mtype != NONE) {
+			fprintf(stderr, "no seed in the trace\n");
+			exit(EXIT_FAILURE);
+		}
+		seed = expected.time;
+		trace_next();
+	}
+	trace(&domains[0], NONE, 0, seed);
 
-				/* create the message queue */
+				/* clients and plugin */
 
-	key = ftok(KEYFILE, TIMESERVER);
-	if (key == -1) {
-		perror(KEYFILE);
+	state_init();
+	clients_init();
+	if (pluginarg != NULL && plugin_load(pluginarg) == -1) {
+		if (stateid != -1)
+			shmctl(stateid, IPC_RMID, NULL);
 		exit(EXIT_FAILURE);
 	}
 
-	queue = msgget(key, IPC_CREAT | 0700);
-	if (queue == -1) {
-		perror("msgget");
-		exit(EXIT_FAILURE);
+				/* create the message queues */
+
+	for (s = 0; s < MAXSHARDS; s++) {
+		shards[s].queue = -1;
+		shards[s].sock = -1;
+		shards[s].log = NULL;
+		pthread_mutex_init(&shards[s].sending, NULL);
+	}
+	lastshard = numshards;
+
+	for (s = 0; s < numshards; s++) {
+		key = ftok(KEYFILE, TIMESERVER + s);
+		if (key == -1) {
+			perror(KEYFILE);
+			exit(EXIT_FAILURE);
+		}
+
+		shards[s].queue = msgget(key, IPC_CREAT | 0700);
+		if (shards[s].queue == -1) {
+			perror("msgget");
+			exit(EXIT_FAILURE);
+		}
+		if (shard_size(&shards[s]) == -1 && qbytes != 0)
+			exit(EXIT_FAILURE);
+
+		shards[s].seed = seed + s;
+		shards[s].log = open_memstream(&shards[s].buf, &shards[s].len);
+	}
+				/* socket for the timerelays */
+
+	if (address != NULL) {
+		listener = net_listen(address);
+		if (listener == -1)
+			exit(EXIT_FAILURE);
 	}
 
 				/* signal handlers */
@@ -247,22 +2213,45 @@ int main(int argn, char *argv[]) {
 	signal(SIGINT, handler);
 	signal(SIGTERM, handler);
 	signal(SIGALRM, handler);
+	signal(SIGUSR1, handler);
 
 				/* init simulation */
 
-	now = 0;
-	end = now;
+	for (s = 0; s < numdomains; s++) {
+		d = &domains[s];
+		d->now = 0;
+		d->end = d->now;
+		d->active = wallclock();
+		gettimeofday(&d->flowed, NULL);
+		d->fraction = 0;
+	}
 
-	clients_init();
+	state_update();
+	numpending = 0;
 
-	timer.it_interval.tv_sec = 0;
-	timer.it_interval.tv_usec = 0;
-	timer.it_value.tv_sec = 0;
 	terminated = 0;
 
-	printf("%s%-9s %-8s %-15s %-10s\n",
-	       origin == 0 ? "" : "date                     ",
+	printf("%s%s%-9s %-8s %-15s %-10s\n",
+	       numdomains == 1 ? "" : "domain ",
+	       dates ? "date                     " : "",
 	       "seconds", "client", "command", "result");
+	fflush(stdout);
+
+				/* threads of the other shards */
+
+	sigemptyset(&blocked);
+	sigaddset(&blocked, SIGINT);
+	sigaddset(&blocked, SIGTERM);
+	sigaddset(&blocked, SIGALRM);
+	sigaddset(&blocked, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &blocked, NULL);
+	for (s = 1; s < numshards; s++)
+		pthread_create(&shards[s].thread, NULL,
+			shard_loop, &shards[s]);
+	if (address != NULL)
+		pthread_create(&listening, NULL, listen_loop, NULL);
+	pthread_create(&retrying, NULL, retry_loop, NULL);
+	pthread_sigmask(SIG_UNBLOCK, &blocked, NULL);
 
 				/* main loop */
 
@@ -270,229 +2259,144 @@ int main(int argn, char *argv[]) {
 
 				/* receive message */
 
-		timeout = 0;
-
-		if (now >= end && end >= 0) {
-			/* simulation run ended, not yet (re)started:
-			 * do not read messages related to time */
-			res = msgrcv(queue, &msg, msgsize, -NOTRUNNING, 0);
-			err = errno;
+		pthread_mutex_lock(&lock);
+		run = 0;
+		jump = -1;
+		expired = -1;
+		wait = idletime;
+		wall = wallclock();
+		for (s = 0; s < numdomains; s++) {
+			d = &domains[s];
+			if (! running(d))
+				continue;
+			run = 1;
+			if (jump == -1 && nofork && replay == NULL &&
+			    d->numclients == d->numsleeping)
+				jump = s;
+			if (expired == -1 && replay == NULL &&
+			    d->active + idletime <= wall)
+				expired = s;
+			wait = MIN(wait, d->active + idletime - wall);
 		}
+		lapsed = replay == NULL ? clients_leased() : -1;
+		if (lapsed != -1 && leases[lapsed] > wall) {
+			wait = MIN(wait, leases[lapsed] - wall);
+			lapsed = -1;
+		}
+		pthread_mutex_unlock(&lock);
 
-		else if (nofork && numclients == numsleeping) {
+		if (jump != -1) {
 			/* non-forking clients are all sleeping: jump to next
 			 * wakeup time or to the end of the simulation run */
 			res = 0;
 			msg.mtype = TIMEOUT;
+			msg.client = jump;
+		}
+		else if (expired != -1) {
+			/* a domain is idle while the others keep the queue
+			 * busy, so that receiving would not time out */
+			res = 1;
+			msg.mtype = TIMEOUT;
+			msg.client = expired;
+		}
+		else if (lapsed != -1) {
+			/* a program executed by a client did not attach */
+			res = 0;
+			msg.mtype = LAPSED;
+			msg.client = lapsed;
+			msg.time = 0;
 		}
-
 		else {
-			/* simulation is running: wait for some time for
-			 * messages from the client */
-			timer.it_value.tv_usec = idletime;
-			setitimer(ITIMER_REAL, &timer, NULL);
-			res = msgrcv(queue, &msg, msgsize, -TOSERVER, 0);
-			err = errno;
-			timer.it_value.tv_usec = 0;
-			setitimer(ITIMER_REAL, &timer, NULL);
+			/* until the first domain is idle; the clients of the
+			 * other shards tell by the time of their messages */
+			res = receive_replay(&shards[0], run,
+				wait > 0 ? wait : 1);
+			if (res == -1)
+				break;
 		}
 
-		if (res == -1 && err == EINTR && timeout && ! terminated)
-			msg.mtype = TIMEOUT;
-		else if (res == -1)
-			break;
+				/* scaled real time */
 
-		printtime(origin, now);
+		flow(shards[0].log);
 
 				/* process message */
 
-		switch (msg.mtype) {
-
-		case NONE:
-			printf(" %-8s %-15s", "", "none()");
-			break;
-
-		case REGISTER:
-			printf(" %-8s %-15s", "", "register()");
-
-			clients_check(queue);
-
-			client = clients_register();
-			if (client == -1) {
-				printf(" %-10s", "cannot register\n");
-				terminated = 1;
-			}
-			else {
-				printf(" id=%ld", client);
-
-				msg.mtype = CLIENTID;
-				msg.client = client;
-				msg.time = origin + now;
-				res = msgsnd(queue, &msg, msgsize, 0);
-				if (res == -1) {
-					perror("msgsnd");
-					break;
-				}
-				numclients++;
-			}
-			break;
-
-		case UNREGISTER:
-			printf(" %-8ld %-15s", msg.client, "unregister()");
-
-			clients_unregister(msg.client);
-			numclients--;
-
-			if (end == NEXTSLEEP) {
-				end = now;
-				printf(" end=%ld", end);
-			}
-			break;
-
-		case PID:
-			printf(" %-8ld", msg.client);
-			sprintf(line, "pid(%ld)", msg.time);
-			printf(" %-15s", line);
-
-			pids[msg.client] = msg.time;
-			break;
-
-		case TIMEOUT:
-			printf(" %-8s", "");
-			printf(" %-15s", res ? "timeout()" : "jump()");
-
-			clients_check(queue);
-			client = clients_next();
-
-			if (idlejump != -1) {
-				now += idlejump;
-				if (now >= end && end >= 0)
-					now = end;
-				if (client != -1 &&
-				    now > clients[client] - SLEEPING + 1)
-					now = clients[client] - SLEEPING + 1;
-			}
-			else {
-				if (client != -1 &&
-				    (clients[client] - SLEEPING < end ||
-				     end < 0))
-					now = clients[client] - SLEEPING + 1;
-				else if (end >= 0)
-					now = end;
-				else if (nofork)
-					end = now;
-			}
-
-			printf(" now=%ld end=%ld", now, end);
-
-			break;
-
-		case RUN:
-			printf(" %-8s", "");
-			sprintf(line, "run(%ld)", msg.time);
-			printf(" %-15s", line);
-
-			end = msg.time < 0 ? msg.time : end + msg.time;
-
-			printf(" end=%ld", end);
-			break;
-
-		case QUERY:
-			client = msg.client;
-
-			printf(" %-8ld", client);
-			printf(" %-15s", "query()");
-
-			msg.mtype = TIME;
-			msg.client = client;
-			msg.time = origin + now;
-			msgsnd(queue, &msg, msgsize, 0);
-			if (busywait && random() % busywait == 0)
-				now++;
-			break;
-
-		case SLEEP:
-			client = msg.client;
-
-			printf(" %-8ld", client);
-			sprintf(line, "sleep(%ld)", msg.time);
-			printf(" %-15s", line);
-
-			clients[client] = SLEEPING + now + msg.time - 1;
-			printf(" wakeup=%ld", clients[client] - SLEEPING + 1);
-			numsleeping++;
+		if (msg.mtype == TIMEOUT) {
+			timeouts(&msg, res);
+			continue;
+		}
+		process(&shards[0], &msg, res);
+		shard_flush(&shards[0]);
+	}
 
-			if (end == NEXTSLEEP) {
-				end = now;
-				printf(" end=%ld", end);
-			}
-			break;
+				/* stop the other shards */
 
-		case CANCEL:
-			client = msg.client;
+	pthread_mutex_lock(&lock);
+	terminated = 1;
+	pthread_cond_broadcast(&runcond);
+	pthread_mutex_unlock(&lock);
 
-			printf(" %-8ld", client);
-			printf(" %-15s", "cancel()");
-			printf(" wakeup(%ld)", client);
+				/* close the connections */
 
-			msg.mtype = WAKE(client);
-			msg.client = client;
-			msg.time = origin + now;
-			msgsnd(queue, &msg, msgsize, 0);
+	if (address != NULL) {
+		shutdown(listener, SHUT_RDWR);
+		pthread_join(listening, NULL);
+		close(listener);
+		pthread_mutex_lock(&lock);
+		for (s = numshards; s < lastshard; s++)
+			if (shards[s].sock != -1)
+				shutdown(shards[s].sock, SHUT_RDWR);
+		pthread_mutex_unlock(&lock);
+	}
 
-			if (clients[client] >= SLEEPING)
-				numsleeping--;
-			clients[client] = RUNNING;
-			break;
+				/* remove queues */
 
-		default:
-			printf("unknown mtype: %ld\n", msg.mtype);
+	for (s = numshards - 1; s >= 0; s--) {
+		res = msgctl(shards[s].queue, IPC_RMID, NULL);
+		if (res == -1) {
+			perror("msgctl");
+			exit(EXIT_FAILURE);
 		}
+		if (s > 0)
+			pthread_join(shards[s].thread, NULL);
+		fclose(shards[s].log);
+		free(shards[s].buf);
+	}
 
-		printf("\n");
-
-				/* wake clients */
+				/* thaw the clients left */
 
-		for (client = 0; client < MAXCLIENTS; client++) {
-			if (clients[client] < SLEEPING)
-				continue;
-			if (clients[client] - SLEEPING >= now)
-				continue;
+	if (cgroup != NULL) {
+		cgroup_freeze(0);
+		rmdir(cgroup);
+	}
 
-			printtime(origin, now);
-			printf(" %-8s %-15s", "", "");
-			printf(" wake(%ld)", client);
+				/* remove the state, still attached until exit */
 
-			msg.mtype = WAKE(client);
-			msg.client = client;
-			msg.time = origin + now;
-			msgsnd(queue, &msg, msgsize, 0);
+	if (stateid != -1)
+		shmctl(stateid, IPC_RMID, NULL);
 
-			clients[client] = RUNNING;
-			numsleeping--;
+				/* close trace */
 
-			if (end == NEXTWAKE) {
-				end = now + 1;
-				printf(" end=%ld", end);
-			}
-			printf("\n");
-		}
-	}
+	if (record != NULL)
+		fclose(record);
 
-				/* remove queue */
+				/* end the plugin */
 
-	res = msgctl(queue, IPC_RMID, NULL);
-	if (res == -1) {
-		perror("msgctl");
-		exit(EXIT_FAILURE);
+	if (plugin_fini != NULL) {
+		plugin_domain(&domains[0]);
+		plugin_fini(&plugin);
 	}
 
 				/* summary */
 
-	printtime(origin, now);
-	printf(" %-8s %-15s", "", "quit()");
-	printf(" registered=%d sleeping=%d\n", numclients, numsleeping);
+	for (s = 0; s < numdomains; s++) {
+		printtime(stdout, &domains[s], domains[s].now);
+		printf(" %-8s %-15s", "", "quit()");
+		printf(" registered=%d sleeping=%d\n",
+			domains[s].numclients, domains[s].numsleeping);
+	}
+	stalls_report(stdout);
+	queues_report(stdout);
 
 	return 0;
 }
-
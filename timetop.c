@@ -0,0 +1,199 @@
+/*
+ * timetop.c
+ *
+ * show the state of the timeserver and of its clients, refreshing it
+ *
+ * timetop [-a] [-d seconds] [-n count]
+ *
+ * -a		sort by activity: the messages sent since the last refresh
+ * -d seconds	time between refreshes; default 1
+ * -n count	stop after this number of refreshes; default is forever
+ *
+ * the default order is by wakeup time, with the running clients first; the
+ * state is read from the shared memory segment of the timeserver, so that
+ * watching it costs nothing to the simulation; with timeserver -d, each domain
+ * has its line, and the clients tell their domain
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/shm.h>
+
+#define NOMSG
+#include "timecontrol.h"
+
+struct timestate *state;
+long *clients, *pids, *messages, *domains, *previous;
+int activity;
+
+/*
+ * copy the arrays of the state, which the timeserver changes meanwhile; the
+ * clients are sorted and printed from the copy, since qsort() needs an order
+ * that does not change while sorting
+ */
+void snapshot() {
+	size_t size;
+
+	size = state->size * sizeof(long);
+	memcpy(clients, STATECLIENTS(state), size);
+	memcpy(pids, STATEPIDS(state), size);
+	memcpy(messages, STATEMESSAGES(state), size);
+	memcpy(domains, STATEDOMAINS(state), size);
+}
+
+/*
+ * order of two clients, by activity or by wakeup time
+ */
+int compare(const void *a, const void *b) {
+	long ca, cb, va, vb;
+
+	ca = *(long *) a;
+	cb = *(long *) b;
+	if (activity) {
+		va = messages[cb] - previous[cb];
+		vb = messages[ca] - previous[ca];
+	}
+	else {
+		va = clients[ca];
+		vb = clients[cb];
+	}
+	return va < vb ? -1 : va > vb ? 1 : ca < cb ? -1 : ca > cb ? 1 : 0;
+}
+
+/*
+ * name of the command of a process
+ */
+void command(long pid, char *name, int len) {
+	char path[40];
+	int fd, res;
+
+	strcpy(name, "-");
+	if (pid == 0)
+		return;
+	snprintf(path, 40, "/proc/%ld/comm", pid);
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		return;
+	res = read(fd, name, len - 1);
+	close(fd);
+	name[res <= 0 ? 0 : name[res - 1] == '\n' ? res - 1 : res] = '\0';
+}
+
+int main(int argn, char *argv[]) {
+	int opt, id, tty, rows, count, i, n, d;
+	long delay, c, *order;
+	key_t key;
+	struct shmid_ds ds;
+	struct winsize ws;
+	char name[20], wakeup[24];
+
+				/* arguments */
+
+	activity = 0;
+	delay = 1;
+	count = 0;
+	while (-1 != (opt = getopt(argn, argv, "ad:n:h")))
+		switch (opt) {
+		case 'a':
+			activity = 1;
+			break;
+		case 'd':
+			delay = atol(optarg);
+			break;
+		case 'n':
+			count = atoi(optarg);
+			break;
+		case 'h':
+		default:
+			printf("usage:\n\ttimetop [-a] [-d seconds] "
+				"[-n count]\n");
+			exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+		}
+
+				/* attach the state of the timeserver */
+
+	key = ftok(KEYFILE, TIMESERVER);
+	id = key == -1 ? -1 : shmget(key, 0, 0);
+	if (id == -1) {
+		printf("timeserver not running\n");
+		exit(EXIT_FAILURE);
+	}
+	state = shmat(id, NULL, SHM_RDONLY);
+	if (state == (void *) -1) {
+		perror("shmat");
+		exit(EXIT_FAILURE);
+	}
+	clients = malloc(state->size * sizeof(long));
+	pids = malloc(state->size * sizeof(long));
+	messages = malloc(state->size * sizeof(long));
+	domains = malloc(state->size * sizeof(long));
+	previous = calloc(state->size, sizeof(long));
+	order = malloc(state->size * sizeof(long));
+
+	tty = isatty(STDOUT_FILENO);
+
+				/* refresh */
+
+	for (i = 0; count == 0 || i < count; i++) {
+		if (shmctl(id, IPC_STAT, &ds) == -1 ||
+		    ds.shm_perm.mode & SHM_DEST) {
+			printf("timeserver ended\n");
+			break;
+		}
+
+		rows = state->size;
+		if (tty && ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) != -1)
+			rows = ws.ws_row - 3 - state->numdomains;
+
+		snapshot();
+		for (n = 0, c = 0; c < state->size; c++)
+			if (clients[c] != EMPTY)
+				order[n++] = c;
+		qsort(order, n, sizeof(long), compare);
+
+		if (tty)
+			printf("\033[H\033[2J");
+		for (d = 0; d < state->numdomains; d++) {
+			if (state->numdomains > 1)
+				printf("domain=%d ", d);
+			printf("now=%ld end=%ld clients=%ld sleeping=%ld\n",
+				state->domains[d].now, state->domains[d].end,
+				state->domains[d].numclients,
+				state->domains[d].numsleeping);
+		}
+		printf("\n");
+		if (state->numdomains > 1)
+			printf("%-7s ", "domain");
+		printf("%-8s %-8s %-16s %-9s %-10s %-10s %s\n",
+			"client", "pid", "command", "state", "wakeup",
+			"messages", "recent");
+		for (c = 0; c < n && c < rows; c++) {
+			if (state->numdomains > 1)
+				printf("%-7ld ", domains[order[c]]);
+			command(pids[order[c]], name, 17);
+			if (clients[order[c]] >= SLEEPING)
+				sprintf(wakeup, "%ld",
+					clients[order[c]] - SLEEPING + 1);
+			else
+				strcpy(wakeup, "-");
+			printf("%-8ld %-8ld %-16s %-9s %-10s %-10ld %ld\n",
+				order[c], pids[order[c]], name,
+				clients[order[c]] >= SLEEPING ?
+					"sleeping" : "running",
+				wakeup, messages[order[c]],
+				messages[order[c]] - previous[order[c]]);
+		}
+		fflush(stdout);
+
+		memcpy(previous, messages, state->size * sizeof(long));
+		if (count == 0 || i < count - 1)
+			sleep(delay);
+	}
+
+	shmdt(state);
+	return EXIT_SUCCESS;
+}
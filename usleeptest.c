@@ -0,0 +1,44 @@
+/*
+ * usleeptest.c
+ *
+ * test the sleeps of a fraction of second under timeserver: each lasts a
+ * simulated second, so that the loops polling with them advance the time
+ *
+ * timeexec usleeptest [count]
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <time.h>
+
+int main(int argn, char *argv[]) {
+	int count, i;
+	time_t start, elapsed;
+	struct timespec ts;
+
+	count = argn - 1 >= 1 ? atoi(argv[1]) : 50;
+
+	start = time(NULL);
+	for (i = 0; i < count; i++)
+		usleep(200000);
+	elapsed = time(NULL) - start;
+	printf("usleep: %d calls, elapsed simulated %ld\n", count, elapsed);
+	if (elapsed < count)
+		return EXIT_FAILURE;
+
+	start = time(NULL);
+	ts.tv_sec = 0;
+	ts.tv_nsec = 200000000;
+	for (i = 0; i < count; i++) {
+		nanosleep(&ts, NULL);
+		clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
+	}
+	elapsed = time(NULL) - start;
+	printf("nanosleep: %d calls, elapsed simulated %ld\n", 2 * count,
+		elapsed);
+	if (elapsed < 2 * count)
+		return EXIT_FAILURE;
+
+	return EXIT_SUCCESS;
+}